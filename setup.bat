@@ -1,2 +1,2 @@
-g++ -O3 -c source/main.cpp -static
-g++ main.o -o fifa21 -static
\ No newline at end of file
+g++ -O3 -pthread -c source/main.cpp -static
+g++ -pthread main.o -o fifa21 -static
\ No newline at end of file
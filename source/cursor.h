@@ -0,0 +1,93 @@
+#ifndef CURSOR_H
+#define CURSOR_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+/**
+ * Continuation cursors let a query resume right after the last row of a page. Each
+ * index stores whatever it needs to resume as a list of 32-bit values; the console
+ * only hands them to the user as an opaque string.
+ */
+typedef std::vector<uint32_t> PageCursor;
+
+/**
+ * Encodes a cursor as an opaque string (8 hex digits per value).
+ *
+ * @param cursor The cursor to encode.
+ * @return The encoded cursor.
+ */
+inline std::string encode_cursor(const PageCursor& cursor) {
+    const char* digits = "0123456789abcdef";
+    std::string text;
+    for (auto& value : cursor) {
+        for (int shift = 28; shift >= 0; shift -= 4) {
+            text.push_back(digits[(value >> shift) & 0xF]);
+        }
+    }
+    return text;
+}
+
+/**
+ * Decodes a cursor previously produced by encode_cursor.
+ *
+ * @param text The encoded cursor.
+ * @param cursor A reference to the cursor that receives the decoded values.
+ * @return True if the text is a valid cursor, false otherwise.
+ */
+inline bool decode_cursor(const std::string& text, PageCursor& cursor) {
+    cursor.clear();
+    if (text.size() % 8 != 0) {
+        return false;
+    }
+    for (size_t i = 0; i < text.size(); i += 8) {
+        uint32_t value = 0;
+        for (size_t j = i; j < i + 8; j++) {
+            char c = text[j];
+            uint32_t digit;
+            if (c >= '0' && c <= '9') {
+                digit = c - '0';
+            }
+            else if (c >= 'a' && c <= 'f') {
+                digit = c - 'a' + 10;
+            }
+            else {
+                return false;
+            }
+            value = (value << 4) | digit;
+        }
+        cursor.push_back(value);
+    }
+    return true;
+}
+
+/**
+ * Stores a rating in two cursor values, keeping every bit of the double.
+ *
+ * @param cursor The cursor to append to.
+ * @param rating The rating to store.
+ */
+inline void push_rating(PageCursor& cursor, double rating) {
+    uint64_t bits;
+    std::memcpy(&bits, &rating, sizeof(bits));
+    cursor.push_back(static_cast<uint32_t>(bits >> 32));
+    cursor.push_back(static_cast<uint32_t>(bits));
+}
+
+/**
+ * Reads a rating stored with push_rating.
+ *
+ * @param cursor The cursor to read from.
+ * @param i The index of the first of the two values.
+ * @return The stored rating.
+ */
+inline double read_rating(const PageCursor& cursor, size_t i) {
+    uint64_t bits = (static_cast<uint64_t>(cursor[i]) << 32) | cursor[i + 1];
+    double rating;
+    std::memcpy(&rating, &bits, sizeof(rating));
+    return rating;
+}
+
+#endif // CURSOR_H
@@ -7,8 +7,8 @@
 template <class Item, class Key = uint32_t>
 class HashMap {
 private:
-    virtual uint32_t hash(Key key) = 0;
-    virtual bool equal(Item item, Key key) = 0;
+    virtual uint32_t hash(const Key& key) = 0;
+    virtual bool equal(const Item& item, const Key& key) = 0;
 
 public:
     uint32_t table_size;
@@ -30,7 +30,7 @@ public:
      * @param key The key associated with the item (32-bit uint).
      * @param item The item to insert into the hash map.
      */
-    void insert(Key key, Item item) {
+    void insert(const Key& key, Item item) {
         uint32_t hash_value = hash(key);
         table[hash_value].push_back(item);
     }
@@ -41,7 +41,7 @@ public:
      * @param key The key associated with the item to search for.
      * @return A pointer to the found item, or nullptr if not found.
      */
-    Item* search(Key key) {
+    Item* search(const Key& key) {
         uint32_t hash_value = hash(key);
         for (auto& item : table[hash_value]) {
             if (equal(item, key)) {
@@ -0,0 +1,199 @@
+#ifndef INTERSECTION_H
+#define INTERSECTION_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Size ratio above which the shorter list gallops through the longer one
+#define GALLOP_RATIO 32
+// Number of IDs of the smallest list intersected at a time
+#define INTERSECTION_WINDOW 1024
+
+typedef std::vector<uint32_t> PostingList;
+
+/**
+ * Finds the first ID that is not lower than a value, using exponential search from
+ * the beginning of the range, so short jumps cost O(log distance).
+ *
+ * @param first The beginning of the sorted range.
+ * @param last The end of the sorted range.
+ * @param value The ID to search for.
+ * @return A pointer to the first ID not lower than value, or last if there is none.
+ */
+inline const uint32_t* gallop(const uint32_t* first, const uint32_t* last, uint32_t value) {
+    // Dense lists usually have the ID within a few positions
+    for (int i = 0; i < 4; i++) {
+        if (first == last || *first >= value) {
+            return first;
+        }
+        first++;
+    }
+    size_t size = last - first;
+    size_t step = 1;
+    size_t low = 0;
+    while (step < size && first[step] < value) {
+        low = step;
+        step *= 2;
+    }
+    return std::lower_bound(first + low, first + std::min(step + 1, size), value);
+}
+
+/**
+ * Intersects two sorted lists of similar size, calling a function for every common
+ * ID in ascending order. Blocks of 4 IDs are compared against each other at once when
+ * SSE2 is available.
+ *
+ * @param a The beginning of the first sorted list.
+ * @param a_end The end of the first sorted list.
+ * @param b The beginning of the second sorted list.
+ * @param b_end The end of the second sorted list.
+ * @param function The function to call, as function(id); returning false stops the intersection.
+ * @return False if the function stopped the intersection, true otherwise.
+ */
+template <class Function>
+bool merge_intersect(const uint32_t* a, const uint32_t* a_end,
+    const uint32_t* b, const uint32_t* b_end, Function function) {
+#ifdef __SSE2__
+    while (a + 4 <= a_end && b + 4 <= b_end) {
+        __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a));
+        __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b));
+        __m128i equal = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi32(va, vb),
+                _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(0, 3, 2, 1)))),
+            _mm_or_si128(_mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(1, 0, 3, 2))),
+                _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(2, 1, 0, 3)))));
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(equal));
+        while (mask) {
+            int i = __builtin_ctz(mask);
+            if (!function(a[i])) {
+                return false;
+            }
+            mask &= mask - 1;
+        }
+        // Advance the block whose last ID is lower (both when they end on the same ID),
+        // without a branch, since either outcome is equally likely
+        uint32_t a_last = a[3];
+        uint32_t b_last = b[3];
+        a += (a_last <= b_last) * 4;
+        b += (b_last <= a_last) * 4;
+    }
+#endif
+    while (a < a_end && b < b_end) {
+        if (*a < *b) {
+            a++;
+        }
+        else if (*b < *a) {
+            b++;
+        }
+        else {
+            if (!function(*a)) {
+                return false;
+            }
+            a++;
+            b++;
+        }
+    }
+    return true;
+}
+
+/**
+ * Intersects a sorted list with a sorted range, appending the common IDs to a vector.
+ * Lists of very different sizes are intersected by galloping through the larger one.
+ *
+ * @param a The first sorted list.
+ * @param b The beginning of the sorted range.
+ * @param b_end The end of the sorted range.
+ * @param out A reference to the vector that receives the common IDs.
+ */
+inline void intersect_into(const std::vector<uint32_t>& a, const uint32_t* b, const uint32_t* b_end,
+    std::vector<uint32_t>& out) {
+    const uint32_t* a_begin = a.data();
+    const uint32_t* a_end = a_begin + a.size();
+    size_t b_size = b_end - b;
+    if (a.size() * GALLOP_RATIO < b_size || b_size * GALLOP_RATIO < a.size()) {
+        if (b_size < a.size()) {
+            std::swap(a_begin, b);
+            std::swap(a_end, b_end);
+        }
+        for (const uint32_t* id = a_begin; id != a_end && b != b_end; id++) {
+            b = gallop(b, b_end, *id);
+            if (b != b_end && *b == *id) {
+                out.push_back(*id);
+            }
+        }
+        return;
+    }
+    merge_intersect(a_begin, a_end, b, b_end, [&](uint32_t id) {
+        out.push_back(id);
+        return true;
+    });
+}
+
+/**
+ * Intersects sorted posting lists in place, calling a function for every ID present
+ * in all of them, in ascending order. The lists are ordered smallest first and walked
+ * in windows of the smallest one: each window is narrowed list by list (block merge,
+ * or galloping when sizes are far apart), so stopping early only costs one window.
+ *
+ * @param lists Pointers to the sorted posting lists (reordered by size).
+ * @param after Only IDs greater than this one are considered (negative to start from the beginning).
+ * @param function The function to call, as function(id); returning false stops the intersection.
+ */
+template <class Function>
+void intersect_postings(std::vector<const PostingList*>& lists, int64_t after, Function function) {
+    if (lists.empty()) {
+        return;
+    }
+    std::sort(lists.begin(), lists.end(), [](const PostingList* a, const PostingList* b) {
+        return a->size() < b->size();
+    });
+
+    // Current position in every list, starting after the given ID
+    std::vector<const uint32_t*> positions(lists.size());
+    std::vector<const uint32_t*> ends(lists.size());
+    for (size_t i = 0; i < lists.size(); i++) {
+        const uint32_t* first = lists[i]->data();
+        ends[i] = first + lists[i]->size();
+        positions[i] = after < 0 ? first
+            : std::upper_bound(first, ends[i], static_cast<uint32_t>(after));
+    }
+
+    std::vector<uint32_t> candidates;
+    std::vector<uint32_t> narrowed;
+    while (positions[0] != ends[0]) {
+        const uint32_t* window_end = positions[0] + std::min<size_t>(INTERSECTION_WINDOW, ends[0] - positions[0]);
+        uint32_t last = window_end[-1];
+        candidates.assign(positions[0], window_end);
+        positions[0] = window_end;
+
+        bool exhausted = false;
+        for (size_t i = 1; i < lists.size() && !candidates.empty(); i++) {
+            // Only the IDs up to the last one of the window can match
+            const uint32_t* end = gallop(positions[i], ends[i], last);
+            if (end != ends[i] && *end == last) {
+                end++;
+            }
+            narrowed.clear();
+            intersect_into(candidates, positions[i], end, narrowed);
+            candidates.swap(narrowed);
+            positions[i] = end;
+            exhausted = exhausted || end == ends[i];
+        }
+        for (auto& id : candidates) {
+            if (!function(id)) {
+                return;
+            }
+        }
+        if (exhausted) {
+            return;
+        }
+    }
+}
+
+#endif // INTERSECTION_H
@@ -2,65 +2,291 @@
 #include <time.h>
 #include <sstream>
 #include <string>
-#include <iomanip>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <climits>
+#include <cmath>
+#include <mutex>
+#include <stdexcept>
 #include "trie.h"
+#include "suffixarray.h"
 #include "hashmap.h"
 #include "playerhashmap.h"
 #include "taghashmap.h"
+#include "tagquery.h"
 #include "ratinghashmap.h"
 #include "positionhashmap.h"
+#include "ratingstore.h"
+#include "similarityindex.h"
+#include "queryplanner.h"
+#include "resultcache.h"
+#include "rowwriter.h"
 
-void build_structures(
+struct Options {
+    bool aggregate_ratings = false;
+    size_t memory_budget = 0;  // In megabytes, 0 keeps the ratings in memory
+    std::string temp_directory = ".";
+    bool similarity = false;
+    bool adjusted_cosine = true;
+    size_t neighbours = 20;
+    unsigned threads = 0;
+    bool bitmap_postings = false;
+    size_t cache_entries = DEFAULT_CACHE_ENTRIES;
+    std::string batch_file;    // Commands to run in batch mode ("-" reads them from stdin), empty for the console
+    unsigned batch_threads = 1;
+};
+
+bool parse_options(int argc, char* argv[], Options& options);
+
+bool parse_count(const std::string& text, size_t& value);
+
+bool build_structures(
+    const Options& options,
     PlayerNameTrie& player_names,
+    NameSuffixArray& name_suffixes,
     PlayerHashMap& players,
     TagHashMap& tags,
     RatingHashMap& ratings,
-    PositionHashMap& positions);
+    ExternalRatingStore& rating_store,
+    PositionHashMap& positions,
+    PlayerSimilarityIndex& similarity);
 
 void start_console(
-    PlayerNameTrie player_names,
-    PlayerHashMap players,
-    TagHashMap tags,
-    RatingHashMap ratings,
-    PositionHashMap positions);
+    const Options& options,
+    PlayerNameTrie& player_names,
+    NameSuffixArray& name_suffixes,
+    PlayerHashMap& players,
+    TagHashMap& tags,
+    RatingHashMap& ratings,
+    ExternalRatingStore& rating_store,
+    PositionHashMap& positions,
+    PlayerSimilarityIndex& similarity);
+
+void run_batch(
+    const Options& options,
+    PlayerNameTrie& player_names,
+    NameSuffixArray& name_suffixes,
+    PlayerHashMap& players,
+    TagHashMap& tags,
+    RatingHashMap& ratings,
+    ExternalRatingStore& rating_store,
+    PositionHashMap& positions,
+    PlayerSimilarityIndex& similarity);
 
-std::string parse_command(std::string line, std::vector<std::string>& arguments);
+bool runs_alone(const std::string& input);
 
-template <typename T>
-void printw(T object, size_t width);
+double percentile(const std::vector<double>& sorted, double q);
 
-std::string positions_to_str(std::vector<std::string> positions);
+bool run_command(
+    const std::string& input,
+    std::ostream& out,
+    const Options& options,
+    PlayerNameTrie& player_names,
+    NameSuffixArray& name_suffixes,
+    PlayerHashMap& players,
+    TagHashMap& tags,
+    RatingHashMap& ratings,
+    ExternalRatingStore& rating_store,
+    PositionHashMap& positions,
+    PlayerSimilarityIndex& similarity,
+    ResultCache& cache);
+
+void run_user_batch(
+    std::ostream& out,
+    const std::vector<std::string>& arguments,
+    unsigned threads,
+    PlayerHashMap& players,
+    RatingHashMap& ratings,
+    ExternalRatingStore& rating_store);
+
+typedef std::map<std::string, std::string> CommandOptions;
+
+std::string parse_command(std::string line, std::vector<std::string>& arguments, CommandOptions& options);
+
+double option_value(const CommandOptions& options, std::string key, double fallback);
+
+bool count_option(std::ostream& out, const CommandOptions& options, const std::string& key, size_t& value,
+    size_t minimum = 0, size_t maximum = SIZE_MAX);
+
+bool page_options(std::ostream& out, const CommandOptions& options, size_t& limit, PageCursor& cursor);
+
+void print_next_page(std::ostream& out, const PageCursor& cursor);
+
+std::string page_key(size_t limit, const PageCursor& cursor);
+
+template <typename Compute>
+std::vector<uint32_t> cached_query(ResultCache& cache, const std::string& key,
+    const std::vector<std::string>& dependencies, PageCursor& cursor, Compute compute);
+
+
+int main(int argc, char* argv[]) {
+    Options options;
+    if (!parse_options(argc, argv, options)) {
+        return 1;
+    }
 
-int main() {
     PlayerNameTrie player_names;
+    NameSuffixArray name_suffixes;
     PlayerHashMap players(12007);
     TagHashMap tags(809);
     RatingHashMap ratings(180043);
+    ExternalRatingStore rating_store;
     PositionHashMap positions(41);
+    PlayerSimilarityIndex similarity;
 
-    build_structures(player_names, players, tags, ratings, positions);
-    start_console(player_names, players, tags, ratings, positions);
+    if (!build_structures(options, player_names, name_suffixes, players, tags, ratings, rating_store, positions, similarity)) {
+        return 1;
+    }
+    if (!options.batch_file.empty()) {
+        run_batch(options, player_names, name_suffixes, players, tags, ratings, rating_store, positions, similarity);
+    }
+    else {
+        start_console(options, player_names, name_suffixes, players, tags, ratings, rating_store, positions, similarity);
+    }
 
     return 0;
 }
 
 const std::string line(100, '=');
 
+/**
+ * Parses the command line options given to the program.
+ * The available options are:
+ *   --ratings <full|aggregate>      Keeps every user's ratings, or only the per-player aggregates.
+ *   --memory-budget <MB>            Builds the user ratings index out of core within this budget.
+ *   --temp-dir <path>               Directory for the out of core run and index files (default ".").
+ *   --similarity <cosine|adjusted>  Precomputes the similar players index.
+ *   --neighbours <k>                Number of neighbours kept per player (default 20).
+ *   --threads <n|all>               Number of threads for parallel stages (default: all cores).
+ *   --postings <sorted|bitmap>      Keeps tag and position posting lists as sorted vectors or compressed bitmaps.
+ *   --cache <entries>               Size of the query result cache (default 1024, 0 disables it).
+ *   --batch <file|->                Runs the commands of a file (or stdin) without prompts instead of the console.
+ *   --batch-threads <n|all>         Number of threads running batch commands (default 1).
+ *
+ * @param argc The number of command line arguments.
+ * @param argv The command line arguments.
+ * @param options A reference to the Options object to be filled.
+ * @return True if the options are valid, false otherwise.
+ */
+bool parse_options(int argc, char* argv[], Options& options) {
+    for (int i = 1; i < argc; i++) {
+        std::string option = argv[i];
+        if (i + 1 >= argc) {
+            std::cout << "[X] Missing value for option " << option << ".\n";
+            return false;
+        }
+        std::string value = argv[++i];
+        size_t count = 0;
+        // Numeric options take a non-negative integer; thread counts also accept "all" (all cores)
+        bool numeric = option == "--memory-budget" || option == "--neighbours" || option == "--threads"
+            || option == "--cache" || option == "--batch-threads";
+        bool all_cores = (option == "--threads" || option == "--batch-threads") && value == "all";
+        if (numeric && !all_cores && (!parse_count(value, count)
+            || (count == 0 && option != "--memory-budget" && option != "--cache")
+            || (option == "--memory-budget" && count > (SIZE_MAX >> 20))
+            || ((option == "--threads" || option == "--batch-threads") && count > UINT_MAX))) {
+            std::cout << "[X] Invalid value for " << option << ": " << value << ".\n";
+            return false;
+        }
+
+        if (option == "--ratings" && (value == "full" || value == "aggregate")) {
+            options.aggregate_ratings = value == "aggregate";
+        }
+        else if (option == "--memory-budget") {
+            options.memory_budget = count;
+        }
+        else if (option == "--temp-dir") {
+            options.temp_directory = value;
+        }
+        else if (option == "--similarity" && (value == "cosine" || value == "adjusted")) {
+            options.similarity = true;
+            options.adjusted_cosine = value == "adjusted";
+        }
+        else if (option == "--neighbours") {
+            options.neighbours = count;
+        }
+        else if (option == "--threads") {
+            options.threads = static_cast<unsigned>(count);  // 0 (all) uses the hardware concurrency
+        }
+        else if (option == "--postings" && (value == "sorted" || value == "bitmap")) {
+            options.bitmap_postings = value == "bitmap";
+        }
+        else if (option == "--cache") {
+            options.cache_entries = count;
+        }
+        else if (option == "--batch") {
+            options.batch_file = value;
+        }
+        else if (option == "--batch-threads") {
+            options.batch_threads = static_cast<unsigned>(count);  // 0 (all) uses the hardware concurrency
+        }
+        else {
+            std::cout << "[X] Invalid option " << option << " " << value << ".\n";
+            return false;
+        }
+    }
+    if (options.aggregate_ratings && options.memory_budget) {
+        std::cout << "[X] The out of core ratings index needs the full ratings (--ratings full).\n";
+        return false;
+    }
+    if (options.memory_budget && options.similarity) {
+        // The index is built from in-memory copies of the whole rating matrix
+        std::cout << "[X] The similar players index can not be built from the out of core ratings index"
+            << " (drop --memory-budget).\n";
+        return false;
+    }
+    if (options.aggregate_ratings && options.similarity) {
+        std::cout << "[X] The similar players index needs the full ratings (--ratings full).\n";
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Parses a non-negative integer, such as the value of a numeric option.
+ *
+ * @param text The text to parse.
+ * @param value A reference that receives the number.
+ * @return True if the text is a non-negative integer that fits in a size_t, false otherwise.
+ */
+bool parse_count(const std::string& text, size_t& value) {
+    if (text.empty() || text.find_first_not_of("0123456789") != std::string::npos) {
+        return false;
+    }
+    try {
+        value = std::stoull(text);
+    }
+    catch (const std::out_of_range&) {
+        return false;
+    }
+    return value <= SIZE_MAX;
+}
+
 /**
  * Builds the necessary data structures for console mode by reading data from CSV files.
  *
+ * @param options The command line options.
  * @param player_names A reference to the PlayerNameTrie object.
+ * @param name_suffixes A reference to the NameSuffixArray object.
  * @param player A reference to the PlayerHashMap object.
  * @param tags A reference to the TagHashMap object.
  * @param ratings A reference to the RatingHashMap object.
+ * @param rating_store A reference to the ExternalRatingStore object.
  * @param positions A reference to the PositionsHashMap object.
+ * @param similarity A reference to the PlayerSimilarityIndex object.
+ * @return True if the data structures were built, false otherwise.
  */
-void build_structures(
+bool build_structures(
+    const Options& options,
     PlayerNameTrie& player_names,
+    NameSuffixArray& name_suffixes,
     PlayerHashMap& players,
     TagHashMap& tags,
     RatingHashMap& ratings,
-    PositionHashMap& positions
+    ExternalRatingStore& rating_store,
+    PositionHashMap& positions,
+    PlayerSimilarityIndex& similarity
 ) {
     std::cout << "\n" << line << "\n"
         << "Reading CSV Files And Building Data Structures\n"
@@ -68,182 +294,937 @@ void build_structures(
 
     clock_t start = clock();
 
-    player_names.from_csv("data/players.csv");
+    player_names.from_csv("data/players.csv", options.threads);
     clock_t end_trie = clock();
     std::cout << "[-] Player Names Trie initialization completed in "
         << double(end_trie - start) / double(CLOCKS_PER_SEC)
         << " seconds." << std::endl;
+    std::cout << "    Bulk build from sorted names took " << player_names.build_seconds * 1000
+        << " ms of it." << std::endl;
+    std::cout << "    " << player_names.node_count() << " radix nodes using " << player_names.bytes() / 1024.0
+        << " KB (" << player_names.character_trie_bytes() / 1024.0 << " KB with one node per character)." << std::endl;
+
+    name_suffixes.from_csv("data/players.csv");
+    clock_t end_suffixes = clock();
+    std::cout << "[-] Player Names Suffix Array built in "
+        << double(end_suffixes - end_trie) / double(CLOCKS_PER_SEC)
+        << " seconds." << std::endl;
+    std::cout << "    " << name_suffixes.size() << " suffixes using " << name_suffixes.bytes() / 1024.0
+        << " KB." << std::endl;
 
     players.from_csv("data/players.csv");
     clock_t end_phash = clock();
     std::cout << "[-] Player Hash Map initialization completed in "
-        << double(end_phash - end_trie) / double(CLOCKS_PER_SEC)
+        << double(end_phash - end_suffixes) / double(CLOCKS_PER_SEC)
         << " seconds." << std::endl;
     std::cout << "    Occupancy rate of " << players.get_occupancy() * 100
         << "%." << std::endl;
 
-    ratings.from_csv("data/rating.csv");
-    clock_t end_rhash = clock();
-    std::cout << "[-] Ratings Hash Map initialization completed in "
-        << double(end_rhash - end_phash) / double(CLOCKS_PER_SEC)
+    clock_t end_ratings;
+    if (options.aggregate_ratings) {
+        players.aggregate_ratings_csv("data/rating.csv");
+        end_ratings = clock();
+        std::cout << "[-] Ratings aggregated into the Players Hash Map in "
+            << double(end_ratings - end_phash) / double(CLOCKS_PER_SEC)
+            << " seconds (user ratings not kept)." << std::endl;
+    }
+    else if (options.memory_budget) {
+        try {
+            rating_store.from_csv("data/rating.csv", options.memory_budget << 20, options.temp_directory, players);
+        }
+        catch (const std::exception& e) {
+            // The store removed its temporary files
+            std::cout << "[X] Could not build the out of core ratings index: " << e.what() << std::endl;
+            return false;
+        }
+        end_ratings = clock();
+        std::cout << "[-] Out of core Ratings Index built in "
+            << double(end_ratings - end_phash) / double(CLOCKS_PER_SEC)
+            << " seconds (" << rating_store.run_count << " sorted runs merged)." << std::endl;
+        std::cout << "    In-memory index of " << rating_store.index_bytes() / 1024.0
+            << " KB, " << rating_store.mapped_bytes() / 1048576.0 << " MB memory mapped." << std::endl;
+    }
+    else {
+        ratings.from_csv("data/rating.csv");
+        clock_t end_rhash = clock();
+        std::cout << "[-] Ratings Hash Map initialization completed in "
+            << double(end_rhash - end_phash) / double(CLOCKS_PER_SEC)
+            << " seconds." << std::endl;
+        std::cout << "    Occupancy rate of " << ratings.get_occupancy() * 100
+            << "%." << std::endl;
+
+        players.load_ratings(ratings);
+        end_ratings = clock();
+        std::cout << "[-] Ratings loaded into the Players Hash Map in "
+            << double(end_ratings - end_rhash) / double(CLOCKS_PER_SEC)
+            << " seconds." << std::endl;
+    }
+
+    players.load_percentiles();
+    clock_t end_percentiles = clock();
+    std::cout << "[-] Rating percentiles computed from the histograms in "
+        << double(end_percentiles - end_ratings) / double(CLOCKS_PER_SEC)
         << " seconds." << std::endl;
-    std::cout << "    Occupancy rate of " << ratings.get_occupancy() * 100
-        << "%." << std::endl;
+    std::cout << "    Histogram column uses "
+        << players.histograms.size() * sizeof(RatingHistogram) / 1024.0
+        << " KB." << std::endl;
 
-    players.load_ratings(ratings);
-    clock_t end_ratings = clock();
-    std::cout << "[-] Ratings loaded into the Players Hash Map in "
-        << double(end_ratings - end_rhash) / double(CLOCKS_PER_SEC)
+    player_names.rank_by([&](uint32_t id) {
+        Player* player = players.search(id);
+        return player ? player->global_rating : 0.0;
+    });
+    clock_t end_rank = clock();
+    std::cout << "[-] Player Names Trie ranked by rating in "
+        << double(end_rank - end_percentiles) / double(CLOCKS_PER_SEC)
         << " seconds." << std::endl;
+    std::cout << "    Best " << TOP_CACHE_SIZE << " players cached per prefix in "
+        << player_names.top_cache_bytes() / 1024.0 << " KB." << std::endl;
 
-    positions.load_players(players);
+    positions.bitmaps = options.bitmap_postings;
+    positions.load_players(players, options.threads);
     clock_t end_poshash = clock();
     std::cout << "[-] Players loaded into the Positions Hash Map in "
-        << double(end_poshash - end_ratings) / double(CLOCKS_PER_SEC)
+        << double(end_poshash - end_rank) / double(CLOCKS_PER_SEC)
         << " seconds." << std::endl;
     std::cout << "    Occupancy rate of " << positions.get_occupancy() * 100
         << "%." << std::endl;
+    std::cout << "    Position posting lists use " << positions.posting_bytes() / 1024.0
+        << " KB (" << (positions.bitmaps ? "bitmaps" : "sorted vectors") << ")." << std::endl;
 
-    tags.from_csv("data/tags.csv");
+    tags.bitmaps = options.bitmap_postings;
+    tags.from_csv("data/tags.csv", options.threads);
     clock_t end_thash = clock();
     std::cout << "[-] Tag Hash Map initialization completed in "
         << double(end_thash - end_poshash) / double(CLOCKS_PER_SEC)
         << " seconds." << std::endl;
     std::cout << "    Occupancy rate of " << tags.get_occupancy() * 100
         << "%." << std::endl;
+    std::cout << "    Tag posting lists use " << tags.posting_bytes() / 1024.0
+        << " KB (" << (tags.bitmaps ? "bitmaps" : "sorted vectors") << ")." << std::endl;
+
+    if (options.similarity) {
+        clock_t start_similarity = clock();
+        auto wall_start = std::chrono::steady_clock::now();
+        similarity.build(players, ratings, options.neighbours, options.adjusted_cosine, options.threads);
+        std::chrono::duration<double> wall = std::chrono::steady_clock::now() - wall_start;
+        std::cout << "[-] Similar Players Index built in " << wall.count()
+            << " seconds (" << double(clock() - start_similarity) / double(CLOCKS_PER_SEC)
+            << " seconds of CPU time)." << std::endl;
+        std::cout << "    " << similarity.co_ratings << " co-rating products over "
+            << (options.threads ? options.threads : default_thread_count()) << " threads, "
+            << similarity.co_ratings / std::max(wall.count(), 1e-9) / 1e6
+            << " million per second." << std::endl;
+    }
 
     std::cout << "[-] Total time elapsed: "
         << double(clock() - start) / double(CLOCKS_PER_SEC)
         << " seconds." << std::endl;
+    return true;
 }
 
 /**
  * Initiates the console mode, allowing the user to execute various commands.
  * The available commands are:
- *   - player <name|prefix>
+ *   - player <name|prefix> [limit=<n>] [after=<cursor>]
+ *   - complete <prefix> [k]
+ *   - fuzzy <name|prefix> [distance] [limit=<n>]
+ *   - contains <text> [limit=<n>] [after=<cursor>]
  *   - user <userID>
- *   - top<n> <position>
- *   - tags <list of tags>
+ *   - users <list of userIDs|file of userIDs>
+ *   - top<n> <list of positions> [min_count=<c>] [limit=<n>] [after=<cursor>]
+ *   - range <position> [min_rating=<r>] [max_rating=<r>] [min_count=<c>] [limit=<n>] [offset=<n>]
+ *   - tags <tag query, e.g. ('Speedster' OR 'Dribbler') AND NOT 'Injury Prone'> [limit=<n>] [after=<cursor>]
+ *   - find [name '<prefix>'] [position '<position>' ...] [tags <tag query>]
+ *          [min_rating=<r>] [max_rating=<r>] [min_count=<c>] [limit=<n>] [offset=<n>]
+ *   - explain find ...
+ *   - similar <sofifa_id> [k] (at most the --neighbours kept per player, default 10)
+ *   - stats <list of sofifa_ids>
+ *   - cache [clear]
+ *   - rate <userID> <sofifa_id> <score>
  *   - exit
+ * @param options The command line options.
  * @param player_names The PlayerNameTrie object, containing the player names with their user ID`s.
+ * @param name_suffixes The NameSuffixArray object, containing the suffixes of the player names.
  * @param player The PlayerHashMap object, containing player information.
  * @param tags The TagHashMap object, containing the tags and the IDs of the players that have them.
  * @param ratings The RatingHashMap object, containing the ratings given by each user.
+ * @param rating_store The ExternalRatingStore object, containing the ratings given by each user when built out of core.
  * @param positions The PositionsHashMap object, containing the positions and players that have them.
+ * @param similarity The PlayerSimilarityIndex object, containing the most similar players of each player.
  */
 void start_console(
-    PlayerNameTrie player_names,
-    PlayerHashMap players,
-    TagHashMap tags,
-    RatingHashMap ratings,
-    PositionHashMap positions
+    const Options& options,
+    PlayerNameTrie& player_names,
+    NameSuffixArray& name_suffixes,
+    PlayerHashMap& players,
+    TagHashMap& tags,
+    RatingHashMap& ratings,
+    ExternalRatingStore& rating_store,
+    PositionHashMap& positions,
+    PlayerSimilarityIndex& similarity
 ) {
     std::cout << "\n" << line << "\n"
         << "Starting Console Mode\n"
         << line << "\n";
 
-    while (true) {
-        std::string command;
-        std::vector<std::string> arguments;
+    ResultCache cache(options.cache_entries);
 
+    while (true) {
+        std::string input;
         std::cout << "$ ";
-        std::getline(std::cin, command);
-        command = parse_command(command, arguments);
-
-        if (command.empty()) {
-            std::cout << "[X] No command was provided.\n";
-            continue;
+        if (!std::getline(std::cin, input)) {
+            return;
         }
-        else if (arguments.empty()) {
-            if (command == "exit") {
+        try {
+            if (!run_command(input, std::cout, options, player_names, name_suffixes, players, tags, ratings,
+                rating_store, positions, similarity, cache)) {
                 return;
             }
-            std::cout << "[X] No arguments were provided.\n";
+        }
+        catch (const std::exception& e) {
+            // Malformed numbers make std::stoul and the like throw
+            std::cout << "[X] Invalid argument (" << e.what() << ").\n";
+        }
+    }
+}
+
+/**
+ * Runs the console commands of a file, or of the standard input when the path is "-",
+ * back to back and without prompts, printing their output as the console would. With
+ * more than one batch thread, the commands between two that must run alone (see
+ * runs_alone) are executed in parallel, and their output is printed in input order.
+ * Reading stops at the end of the input or at an exit command. At the end, the
+ * throughput and latency percentiles of every command type are reported; the latency
+ * of a command is the time taken to execute it and format its output.
+ *
+ * @param options The command line options.
+ * @param player_names The PlayerNameTrie object, containing the player names with their user ID`s.
+ * @param name_suffixes The NameSuffixArray object, containing the suffixes of the player names.
+ * @param player The PlayerHashMap object, containing player information.
+ * @param tags The TagHashMap object, containing the tags and the IDs of the players that have them.
+ * @param ratings The RatingHashMap object, containing the ratings given by each user.
+ * @param rating_store The ExternalRatingStore object, containing the ratings given by each user when built out of core.
+ * @param positions The PositionsHashMap object, containing the positions and players that have them.
+ * @param similarity The PlayerSimilarityIndex object, containing the most similar players of each player.
+ */
+void run_batch(
+    const Options& options,
+    PlayerNameTrie& player_names,
+    NameSuffixArray& name_suffixes,
+    PlayerHashMap& players,
+    TagHashMap& tags,
+    RatingHashMap& ratings,
+    ExternalRatingStore& rating_store,
+    PositionHashMap& positions,
+    PlayerSimilarityIndex& similarity
+) {
+    const size_t window_size = 1024;  // Commands whose output is held before printing it
+    std::cout << "\n" << line << "\n"
+        << "Starting Batch Mode\n"
+        << line << "\n";
+
+    std::ifstream file;
+    if (options.batch_file != "-") {
+        file.open(options.batch_file);
+        if (!file) {
+            std::cout << "[X] Could not open file " << options.batch_file << ".\n";
+            return;
+        }
+    }
+    std::istream& in = options.batch_file == "-" ? std::cin : file;
+    std::vector<std::string> commands;
+    std::string input;
+    while (std::getline(in, input)) {
+        if (!input.empty() && input.back() == '\r') {
+            input.pop_back();
+        }
+        if (input.find_first_not_of(' ') == std::string::npos) {
             continue;
         }
+        if (input.substr(0, input.find(' ')) == "exit") {
+            break;
+        }
+        commands.push_back(input);
+    }
 
-        std::cout << "\n";
+    unsigned threads = options.batch_threads ? options.batch_threads : default_thread_count();
+    ResultCache cache(options.cache_entries);
+    std::vector<double> latencies(commands.size());
+    std::vector<std::string> outputs(std::min(window_size, commands.size()));
+    auto start = std::chrono::steady_clock::now();
 
-        if (command == "player") {
-            const std::vector<std::string> headers = { "sofifa_id", "name", "player_positions", "rating", "count" };
-            const std::vector<size_t> w = { 12, 50, 20, 10, 10 };
-            for (size_t i = 0; i < headers.size(); i++) {
-                printw(headers[i], w[i]);
-            }
-            std::cout << "\n";
-            for (auto& id : player_names.search(arguments[0])) {
-                Player player = *(players.search(id));
-                std::string pos = positions_to_str(player.positions);
-                printw(player.id, w[0]);
-                printw(player.name, w[1]);
-                printw(pos, w[2]);
-                printw(player.global_rating, w[3]);
-                printw(player.rating_count, w[4]);
-                std::cout << "\n";
+    for (size_t first = 0; first < commands.size();) {
+        size_t last = first + 1;
+        if (threads > 1 && !runs_alone(commands[first])) {
+            while (last < commands.size() && last - first < window_size && !runs_alone(commands[last])) {
+                last++;
             }
         }
-        else if (command == "user") {
-            const std::vector<std::string> headers = { "sofifa_id", "name", "global_rating", "count", "rating" };
-            const std::vector<size_t> w = { 12, 50, 18, 10, 10 };
-            for (size_t i = 0; i < headers.size(); i++) {
-                printw(headers[i], w[i]);
+        parallel_for(last - first, [&](size_t i, unsigned) {
+            std::ostringstream out;
+            auto command_start = std::chrono::steady_clock::now();
+            try {
+                run_command(commands[first + i], out, options, player_names, name_suffixes, players, tags, ratings,
+                    rating_store, positions, similarity, cache);
             }
-            std::cout << "\n";
-            for (auto& rating : ratings.top20_from_user(std::stoull(arguments[0]))) {
-                Player player = *(players.search(rating.player_id));
-                printw(player.id, w[0]);
-                printw(player.name, w[1]);
-                printw(player.global_rating, w[2]);
-                printw(player.rating_count, w[3]);
-                printw(rating.score, w[4]);
-                std::cout << "\n";
+            catch (const std::exception& e) {
+                // A malformed line is reported in its output, and the batch goes on
+                out << "[X] Invalid argument (" << e.what() << ").\n";
             }
+            latencies[first + i] = std::chrono::duration<double, std::milli>(
+                std::chrono::steady_clock::now() - command_start).count();
+            outputs[i] = out.str();
+        }, threads);
+        for (size_t i = 0; i < last - first; i++) {
+            std::cout << outputs[i];
         }
-        else if (command.rfind("top", 0) == 0) {
-            size_t n = stoull(command.substr(3));
-            const std::vector<std::string> headers = { "#", "sofifa_id", "name", "player_positions", "rating", "count" };
-            const std::vector<size_t> w = { 5, 12, 50, 19, 10, 10 };
-            for (size_t i = 0; i < headers.size(); i++) {
-                printw(headers[i], w[i]);
+        first = last;
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    // Commands are grouped by name, with every top<n> counted as top
+    std::map<std::string, std::vector<double>> types;
+    for (size_t i = 0; i < commands.size(); i++) {
+        std::string command = commands[i].substr(0, commands[i].find(' '));
+        if (command.rfind("top", 0) == 0) {
+            command = "top";
+        }
+        types[command].push_back(latencies[i]);
+    }
+
+    std::cout << "\n" << line << "\n"
+        << "Batch Summary\n"
+        << line << "\n";
+    std::cout << "[-] " << commands.size() << " commands in " << elapsed.count() << " seconds ("
+        << commands.size() / std::max(elapsed.count(), 1e-9) << " queries/s over " << threads << " threads).\n\n";
+    const std::vector<std::string> headers = { "command", "count", "queries/s", "mean ms", "p50 ms", "p90 ms", "p99 ms", "max ms" };
+    const std::vector<size_t> w = { 12, 10, 12, 12, 12, 12, 12, 12 };
+    RowWriter rows(std::cout);
+    rows.header(headers, w);
+    for (auto& type : types) {
+        std::vector<double>& times = type.second;
+        std::sort(times.begin(), times.end());
+        double total = 0;
+        for (auto& time : times) {
+            total += time;
+        }
+        rows.cell(type.first, w[0]);
+        rows.cell(times.size(), w[1]);
+        rows.cell(times.size() / std::max(total / 1000, 1e-9), w[2]);
+        rows.cell(total / times.size(), w[3]);
+        rows.cell(percentile(times, 0.5), w[4]);
+        rows.cell(percentile(times, 0.9), w[5]);
+        rows.cell(percentile(times, 0.99), w[6]);
+        rows.cell(times.back(), w[7]);
+        rows.end_row();
+    }
+}
+
+/**
+ * Checks whether a batch command has to run alone rather than in parallel with its
+ * neighbours: rate changes the indexes, cache reads or clears the cache statistics,
+ * and users runs in parallel itself.
+ *
+ * @param input The command line.
+ * @return True if the command runs alone, false otherwise.
+ */
+bool runs_alone(const std::string& input) {
+    std::string command = input.substr(0, input.find(' '));
+    return command == "rate" || command == "cache" || command == "users";
+}
+
+/**
+ * Returns a percentile of sorted values, using the nearest rank.
+ *
+ * @param sorted The values, in ascending order (not empty).
+ * @param q The percentile, between 0 and 1.
+ * @return The smallest value with at least q of the values at or below it.
+ */
+double percentile(const std::vector<double>& sorted, double q) {
+    size_t rank = static_cast<size_t>(std::ceil(q * sorted.size()));
+    return sorted[std::min(sorted.size(), std::max<size_t>(rank, 1)) - 1];
+}
+
+/**
+ * Executes one console command, writing its output to a stream. The available
+ * commands are listed in start_console.
+ *
+ * @param input The command line.
+ * @param out The stream receiving the output of the command.
+ * @param options The command line options.
+ * @param player_names The PlayerNameTrie object, containing the player names with their user ID`s.
+ * @param name_suffixes The NameSuffixArray object, containing the suffixes of the player names.
+ * @param player The PlayerHashMap object, containing player information.
+ * @param tags The TagHashMap object, containing the tags and the IDs of the players that have them.
+ * @param ratings The RatingHashMap object, containing the ratings given by each user.
+ * @param rating_store The ExternalRatingStore object, containing the ratings given by each user when built out of core.
+ * @param positions The PositionsHashMap object, containing the positions and players that have them.
+ * @param similarity The PlayerSimilarityIndex object, containing the most similar players of each player.
+ * @param cache The result cache.
+ * @return False if the command was exit, true otherwise.
+ */
+bool run_command(
+    const std::string& input,
+    std::ostream& out,
+    const Options& options,
+    PlayerNameTrie& player_names,
+    NameSuffixArray& name_suffixes,
+    PlayerHashMap& players,
+    TagHashMap& tags,
+    RatingHashMap& ratings,
+    ExternalRatingStore& rating_store,
+    PositionHashMap& positions,
+    PlayerSimilarityIndex& similarity,
+    ResultCache& cache
+) {
+    std::vector<std::string> arguments;
+    CommandOptions command_options;
+    std::string command = parse_command(input, arguments, command_options);
+
+    if (command.empty()) {
+        out << "[X] No command was provided.\n";
+        return true;
+    }
+    else if (arguments.empty() && command != "find" && command != "cache") {
+        if (command == "exit") {
+            return false;
+        }
+        out << "[X] No arguments were provided.\n";
+        return true;
+    }
+
+    out << "\n";
+
+    if (command == "player") {
+        size_t limit;
+        PageCursor cursor;
+        if (!page_options(out, command_options, limit, cursor)) {
+            return true;
+        }
+        const std::vector<std::string> headers = { "sofifa_id", "name", "player_positions", "rating", "count" };
+        const std::vector<size_t> w = { 12, 50, 20, 10, 10 };
+        RowWriter rows(out);
+        rows.header(headers, w);
+        // The trie folds letter case, so prefixes differing only in case share an entry
+        std::string prefix = arguments[0];
+        for (auto& c : prefix) {
+            c = static_cast<char>(toupper(static_cast<unsigned char>(c)));
+        }
+        std::vector<uint32_t> ids = cached_query(cache, "player|" + prefix + page_key(limit, cursor),
+            { "names" }, cursor, [&]() { return player_names.search(arguments[0], limit, cursor); });
+        for (auto& id : ids) {
+            const Player& player = *players.search(id);
+            rows.cell(player.id, w[0]);
+            rows.cell(player.name, w[1]);
+            rows.cell(player.positions_text, w[2]);
+            rows.cell(player.global_rating, w[3]);
+            rows.cell(player.rating_count, w[4]);
+            rows.end_row();
+        }
+        rows.flush();
+        print_next_page(out, cursor);
+    }
+    else if (command == "contains") {
+        size_t limit;
+        PageCursor cursor;
+        if (!page_options(out, command_options, limit, cursor)) {
+            return true;
+        }
+        const std::vector<std::string> headers = { "sofifa_id", "name", "player_positions", "rating", "count" };
+        const std::vector<size_t> w = { 12, 50, 20, 10, 10 };
+        RowWriter rows(out);
+        rows.header(headers, w);
+        std::string text = arguments[0];
+        for (auto& c : text) {
+            c = static_cast<char>(toupper(static_cast<unsigned char>(c)));
+        }
+        std::vector<uint32_t> ids = cached_query(cache, "contains|" + text + page_key(limit, cursor),
+            { "names" }, cursor, [&]() { return name_suffixes.search(arguments[0], limit, cursor); });
+        for (auto& id : ids) {
+            const Player& player = *players.search(id);
+            rows.cell(player.id, w[0]);
+            rows.cell(player.name, w[1]);
+            rows.cell(player.positions_text, w[2]);
+            rows.cell(player.global_rating, w[3]);
+            rows.cell(player.rating_count, w[4]);
+            rows.end_row();
+        }
+        rows.flush();
+        print_next_page(out, cursor);
+    }
+    else if (command == "fuzzy") {
+        uint32_t distance = arguments.size() > 1 ? std::stoul(arguments[1]) : 1;
+        size_t limit = DEFAULT_FUZZY_LIMIT;
+        if (!count_option(out, command_options, "limit", limit, 1)) {
+            return true;
+        }
+        if (distance > MAX_EDIT_DISTANCE) {
+            out << "[X] The distance can be at most " << MAX_EDIT_DISTANCE << ".\n";
+            return true;
+        }
+        const std::vector<std::string> headers = { "#", "sofifa_id", "name", "player_positions", "distance", "rating", "count" };
+        const std::vector<size_t> w = { 5, 12, 50, 19, 10, 10, 10 };
+        RowWriter rows(out);
+        rows.header(headers, w);
+        size_t i = 1;
+        for (auto& match : player_names.fuzzy_search(arguments[0], distance, limit)) {
+            const Player& player = *players.search(match.player_id);
+            rows.cell(i++, w[0]);
+            rows.cell(player.id, w[1]);
+            rows.cell(player.name, w[2]);
+            rows.cell(player.positions_text, w[3]);
+            rows.cell(match.distance, w[4]);
+            rows.cell(player.global_rating, w[5]);
+            rows.cell(player.rating_count, w[6]);
+            rows.end_row();
+        }
+    }
+    else if (command == "complete") {
+        size_t k = arguments.size() > 1 ? std::stoull(arguments[1]) : 10;
+        const std::vector<std::string> headers = { "#", "sofifa_id", "name", "player_positions", "rating", "count" };
+        const std::vector<size_t> w = { 5, 12, 50, 19, 10, 10 };
+        RowWriter rows(out);
+        rows.header(headers, w);
+        size_t i = 1;
+        for (auto& id : player_names.top(arguments[0], k)) {
+            const Player& player = *players.search(id);
+            rows.cell(i++, w[0]);
+            rows.cell(player.id, w[1]);
+            rows.cell(player.name, w[2]);
+            rows.cell(player.positions_text, w[3]);
+            rows.cell(player.global_rating, w[4]);
+            rows.cell(player.rating_count, w[5]);
+            rows.end_row();
+        }
+    }
+    else if (command == "user") {
+        if (!ratings.loaded && !rating_store.loaded) {
+            out << "[X] User ratings were not loaded (started with --ratings aggregate).\n";
+            return true;
+        }
+        uint32_t user_id = static_cast<uint32_t>(std::stoul(arguments[0]));
+        const std::vector<std::string> headers = { "sofifa_id", "name", "global_rating", "count", "rating" };
+        const std::vector<size_t> w = { 12, 50, 18, 10, 10 };
+        RowWriter rows(out);
+        rows.header(headers, w);
+        // Reads the ratings without sorting them in place, as batch mode may run user commands in parallel
+        std::vector<Rating> top;
+        if (rating_store.loaded) {
+            rating_store.top_from_user(user_id, 20, top);
+        }
+        else {
+            ratings.top_from_user(user_id, 20, top);
+        }
+        for (auto& rating : top) {
+            const Player& player = *players.search(rating.player_id);
+            rows.cell(player.id, w[0]);
+            rows.cell(player.name, w[1]);
+            rows.cell(player.global_rating, w[2]);
+            rows.cell(player.rating_count, w[3]);
+            rows.cell(rating.score, w[4]);
+            rows.end_row();
+        }
+    }
+    else if (command == "users") {
+        if (!ratings.loaded && !rating_store.loaded) {
+            out << "[X] User ratings were not loaded (started with --ratings aggregate).\n";
+            return true;
+        }
+        run_user_batch(out, arguments, options.threads, players, ratings, rating_store);
+    }
+    else if (command.rfind("top", 0) == 0) {
+        size_t n = stoull(command.substr(3));
+        size_t limit;
+        PageCursor cursor;
+        if (!page_options(out, command_options, limit, cursor)) {
+            return true;
+        }
+        if (!cursor.empty() && cursor.size() != 4) {
+            // top cursors hold the last rating, the last ID and the rank
+            out << "[X] Invalid cursor.\n";
+            return true;
+        }
+        size_t min_count = DEFAULT_MIN_RATING_COUNT;
+        if (!count_option(out, command_options, "min_count", min_count, 0, UINT32_MAX)) {
+            return true;
+        }
+        const std::vector<std::string> headers = { "#", "sofifa_id", "name", "player_positions", "rating", "count" };
+        const std::vector<size_t> w = { 5, 12, 50, 19, 10, 10 };
+        RowWriter rows(out);
+        rows.header(headers, w);
+        size_t i = cursor.empty() ? 1 : cursor[3] + 1;
+        // The positions are merged as a set, so their order does not matter
+        std::vector<std::string> sorted_positions = arguments;
+        std::sort(sorted_positions.begin(), sorted_positions.end());
+        std::string key = "top|" + std::to_string(n) + "|" + std::to_string(min_count);
+        std::vector<std::string> dependencies;
+        for (auto& position : sorted_positions) {
+            key += "|" + position;
+            dependencies.push_back("position:" + position);
+        }
+        std::vector<uint32_t> ids = cached_query(cache, key + page_key(limit, cursor), dependencies, cursor,
+            [&]() { return positions.topn(n, arguments, min_count, limit, cursor); });
+        for (auto& id : ids) {
+            const Player& player = *players.search(id);
+            rows.cell(i++, w[0]);
+            rows.cell(player.id, w[1]);
+            rows.cell(player.name, w[2]);
+            rows.cell(player.positions_text, w[3]);
+            rows.cell(player.global_rating, w[4]);
+            rows.cell(player.rating_count, w[5]);
+            rows.end_row();
+        }
+        rows.flush();
+        print_next_page(out, cursor);
+    }
+    else if (command == "range") {
+        double min_rating = option_value(command_options, "min_rating", 0);
+        double max_rating = option_value(command_options, "max_rating", RATING_BUCKETS * RATING_STEP);
+        size_t min_count = 0;
+        size_t offset = 0;
+        size_t limit = SIZE_MAX;
+        if (!count_option(out, command_options, "min_count", min_count, 0, UINT32_MAX)
+            || !count_option(out, command_options, "offset", offset)
+            || !count_option(out, command_options, "limit", limit, 1)) {
+            return true;
+        }
+        const std::vector<std::string> headers = { "#", "sofifa_id", "name", "player_positions", "rating", "count" };
+        const std::vector<size_t> w = { 7, 12, 50, 19, 10, 10 };
+        RowWriter rows(out);
+        rows.header(headers, w);
+        size_t i = offset + 1;
+        for (auto& id : positions.range(arguments[0], min_rating, max_rating, min_count, offset, limit)) {
+            const Player& player = *players.search(id);
+            rows.cell(i++, w[0]);
+            rows.cell(player.id, w[1]);
+            rows.cell(player.name, w[2]);
+            rows.cell(player.positions_text, w[3]);
+            rows.cell(player.global_rating, w[4]);
+            rows.cell(player.rating_count, w[5]);
+            rows.end_row();
+        }
+    }
+    else if (command == "tags") {
+        size_t limit;
+        PageCursor cursor;
+        if (!page_options(out, command_options, limit, cursor)) {
+            return true;
+        }
+        TagQuery query;
+        if (!query.parse(input.substr(command.size()), tags)) {
+            out << "[X] " << query.get_error() << "\n";
+            return true;
+        }
+        const std::vector<std::string> headers = { "sofifa_id", "name", "player_positions", "rating", "count" };
+        const std::vector<size_t> w = { 12, 50, 19, 10, 10 };
+        RowWriter rows(out);
+        rows.header(headers, w);
+        std::vector<uint32_t> ids = cached_query(cache, "tags|" + query.canonical() + page_key(limit, cursor),
+            { "tags" }, cursor, [&]() { return query.evaluate(limit, cursor); });
+        for (auto& id : ids) {
+            const Player& player = *players.search(id);
+            rows.cell(player.id, w[0]);
+            rows.cell(player.name, w[1]);
+            rows.cell(player.positions_text, w[2]);
+            rows.cell(player.global_rating, w[3]);
+            rows.cell(player.rating_count, w[4]);
+            rows.end_row();
+        }
+        rows.flush();
+        print_next_page(out, cursor);
+    }
+    else if (command == "find" || command == "explain") {
+        bool explain = command == "explain";
+        std::string text = input.substr(command.size());
+        if (explain) {
+            // explain takes a whole find command
+            size_t start = text.find_first_not_of(' ');
+            if (start == std::string::npos || text.compare(start, 4, "find") != 0) {
+                out << "[X] Usage: explain find <predicates>.\n";
+                return true;
             }
-            std::cout << "\n";
+            text = text.substr(start + 4);
+        }
+        PlayerQuery query;
+        if (!query.parse(text, tags)) {
+            out << "[X] " << query.get_error() << "\n";
+            return true;
+        }
+        size_t min_count = 0;
+        size_t limit = SIZE_MAX;
+        size_t offset = 0;
+        if (!count_option(out, command_options, "min_count", min_count, 0, UINT32_MAX)
+            || !count_option(out, command_options, "limit", limit, 1)
+            || !count_option(out, command_options, "offset", offset)) {
+            return true;
+        }
+        if (command_options.count("min_rating") || command_options.count("max_rating")
+            || command_options.count("min_count")) {
+            query.set_rating_filter(
+                option_value(command_options, "min_rating", -std::numeric_limits<double>::infinity()),
+                option_value(command_options, "max_rating", std::numeric_limits<double>::infinity()),
+                static_cast<uint32_t>(min_count));
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        std::vector<uint32_t> result;
+        if (!query.execute(player_names, players, positions, offset, limit, result)) {
+            out << "[X] " << query.get_error() << "\n";
+            return true;
+        }
+        double elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        if (explain) {
+            const std::vector<std::string> headers = { "#", "stage", "predicate", "access", "estimate", "rows" };
+            const std::vector<size_t> w = { 4, 7, 45, 28, 10, 10 };
+            RowWriter rows(out);
+            rows.header(headers, w);
             size_t i = 1;
-            for (auto& id : positions.topn(n, arguments[0])) {
-                Player player = *(players.search(id));
-                std::string pos = positions_to_str(player.positions);
-                printw(i++, w[0]);
-                printw(player.id, w[1]);
-                printw(player.name, w[2]);
-                printw(pos, w[3]);
-                printw(player.global_rating, w[4]);
-                printw(player.rating_count, w[5]);
-                std::cout << "\n";
+            for (auto& stage : query.plan()) {
+                std::string predicate = stage.predicate.size() < w[2] ? stage.predicate
+                    : stage.predicate.substr(0, w[2] - 4) + "...";
+                rows.cell(i++, w[0]);
+                rows.cell(stage.operation, w[1]);
+                rows.cell(predicate, w[2]);
+                rows.cell(stage.access, w[3]);
+                rows.cell(stage.estimate == SIZE_MAX ? std::string("-") : std::to_string(stage.estimate), w[4]);
+                rows.cell(stage.rows, w[5]);
+                rows.end_row();
             }
+            rows.flush();
+            out << "\n[-] " << result.size() << " players returned in " << elapsed << " ms.\n";
+            return true;
+        }
+
+        const std::vector<std::string> headers = { "#", "sofifa_id", "name", "player_positions", "rating", "count" };
+        const std::vector<size_t> w = { 5, 12, 50, 19, 10, 10 };
+        RowWriter rows(out);
+        rows.header(headers, w);
+        size_t i = offset + 1;
+        for (auto& id : result) {
+            const Player& player = *players.search(id);
+            rows.cell(i++, w[0]);
+            rows.cell(player.id, w[1]);
+            rows.cell(player.name, w[2]);
+            rows.cell(player.positions_text, w[3]);
+            rows.cell(player.global_rating, w[4]);
+            rows.cell(player.rating_count, w[5]);
+            rows.end_row();
+        }
+    }
+    else if (command == "cache") {
+        if (!arguments.empty() && arguments[0] == "clear") {
+            cache.clear();
+            out << "[-] Result cache cleared.\n";
+            return true;
+        }
+        out << "[-] Result cache: " << cache.size() << " of " << cache.get_capacity() << " entries.\n"
+            << "    " << cache.hits << " hits, " << cache.misses << " misses, hit rate of "
+            << cache.hit_rate() * 100 << "%.\n"
+            << "    " << cache.evictions << " evictions, " << cache.invalidations << " invalidated entries.\n";
+        if (cache.hits) {
+            out << "    Hits answered in " << cache.hit_seconds / cache.hits * 1e6 << " us on average.\n";
+        }
+        if (cache.misses) {
+            out << "    Misses answered in " << cache.miss_seconds / cache.misses * 1e6 << " us on average.\n";
         }
-        else if (command == "tags") {
-            const std::vector<std::string> headers = { "sofifa_id", "name", "player_positions", "rating", "count" };
-            const std::vector<size_t> w = { 12, 50, 19, 10, 10 };
-            for (size_t i = 0; i < headers.size(); i++) {
-                printw(headers[i], w[i]);
+    }
+    else if (command == "stats") {
+        std::vector<uint32_t> ids;
+        for (auto& argument : arguments) {
+            ids.push_back(static_cast<uint32_t>(std::stoul(argument)));
+        }
+        const std::vector<std::string> headers = { "sofifa_id", "name", "rating", "count", "p10", "median", "p90" };
+        const std::vector<size_t> w = { 12, 40, 10, 10, 7, 7, 7 };
+        RowWriter rows(out);
+        for (size_t i = 0; i < headers.size(); i++) {
+            rows.cell(headers[i], w[i]);
+        }
+        for (size_t b = 0; b < RATING_BUCKETS; b++) {
+            rows.cell((b + 1) * RATING_STEP, 7);
+        }
+        rows.end_row();
+        for (auto& id : ids) {
+            Player* player = players.search(id);
+            if (!player) {
+                continue;
             }
-            std::cout << "\n";
-            for (auto& id : tags.search_tags(arguments)) {
-                Player player = *(players.search(id));
-                std::string pos = positions_to_str(player.positions);
-                printw(player.id, w[0]);
-                printw(player.name, w[1]);
-                printw(pos, w[2]);
-                printw(player.global_rating, w[3]);
-                printw(player.rating_count, w[4]);
-                std::cout << "\n";
+            rows.cell(player->id, w[0]);
+            rows.cell(player->name, w[1]);
+            rows.cell(player->global_rating, w[2]);
+            rows.cell(player->rating_count, w[3]);
+            rows.cell(player->p10, w[4]);
+            rows.cell(player->median, w[5]);
+            rows.cell(player->p90, w[6]);
+            for (auto& count : players.histograms[player->index]) {
+                rows.cell(count, 7);
             }
+            rows.end_row();
         }
-        else {
-            std::cout << "[X] Invalid command.\n";
+    }
+    else if (command == "rate") {
+        if (arguments.size() < 3) {
+            out << "[X] Usage: rate <userID> <sofifa_id> <score>.\n";
+            return true;
+        }
+        uint32_t user_id = static_cast<uint32_t>(std::stoul(arguments[0]));
+        Rating rating = { static_cast<uint32_t>(std::stoul(arguments[1])), std::stof(arguments[2]) };
+        Player* player = players.search(rating.player_id);
+        if (!player) {
+            out << "[X] Player not found.\n";
+            return true;
+        }
+        if (rating.score < RATING_STEP || rating.score > RATING_BUCKETS * RATING_STEP) {
+            out << "[X] Score must be between " << RATING_STEP << " and "
+                << RATING_BUCKETS * RATING_STEP << ".\n";
+            return true;
         }
+        double old_rating = player->global_rating;
+        uint32_t old_count = player->rating_count;
+        players.add_rating(*player, rating.score);
+        players.update_percentiles(*player);
+        positions.update_player(*player, old_rating, old_count);
+        player_names.update_score(player->name, player->id, player->global_rating);
+        for (auto& position : player->positions) {
+            cache.invalidate("position:" + position);
+        }
+        if (ratings.loaded) {
+            ratings.insert_rating_to_user(rating, user_id);
+        }
+        else if (rating_store.loaded) {
+            rating_store.insert_rating_to_user(rating, user_id);
+        }
+        out << "[-] Rating recorded, " << player->name << " now has a rating of "
+            << player->global_rating << " from " << player->rating_count << " ratings.\n";
+    }
+    else if (command == "similar") {
+        Player* target = players.search(std::stoul(arguments[0]));
+        if (!similarity.built) {
+            out << "[X] Similar players index was not built (use --similarity).\n";
+            return true;
+        }
+        if (!target) {
+            out << "[X] Player not found.\n";
+            return true;
+        }
+        size_t k = arguments.size() > 1 ? std::stoull(arguments[1]) : std::min<size_t>(10, similarity.max_neighbours());
+        if (k > similarity.max_neighbours()) {
+            out << "[X] Only " << similarity.max_neighbours() << " neighbours are kept per player (see --neighbours).\n";
+            return true;
+        }
+        const std::vector<std::string> headers = { "sofifa_id", "name", "player_positions", "rating", "count", "similarity" };
+        const std::vector<size_t> w = { 12, 50, 19, 10, 10, 10 };
+        RowWriter rows(out);
+        rows.header(headers, w);
+        for (auto& neighbour : similarity.similar(*target, k)) {
+            const Player& player = *players.search(neighbour.player_id);
+            rows.cell(player.id, w[0]);
+            rows.cell(player.name, w[1]);
+            rows.cell(player.positions_text, w[2]);
+            rows.cell(player.global_rating, w[3]);
+            rows.cell(player.rating_count, w[4]);
+            rows.cell(neighbour.similarity, w[5]);
+            rows.end_row();
+        }
+    }
+    else {
+        out << "[X] Invalid command.\n";
+    }
+
+    out << "\n";
+    return true;
+}
 
-        std::cout << "\n";
+/**
+ * Prints the top 20 ratings of many users, processing them in parallel batches and
+ * printing the results in the same order as the user IDs were given.
+ *
+ * @param out The stream to print to.
+ * @param arguments The user IDs, or the path of a file containing them.
+ * @param threads The number of threads to use (0 uses the hardware concurrency).
+ * @param players The PlayerHashMap object, containing player information.
+ * @param ratings The RatingHashMap object, containing the ratings given by each user.
+ * @param rating_store The ExternalRatingStore object, used instead of ratings when loaded.
+ */
+void run_user_batch(
+    std::ostream& out,
+    const std::vector<std::string>& arguments,
+    unsigned threads,
+    PlayerHashMap& players,
+    RatingHashMap& ratings,
+    ExternalRatingStore& rating_store
+) {
+    const size_t batch_size = 4096;
+    std::vector<uint32_t> user_ids;
+    if (arguments[0].find_first_not_of("0123456789") == std::string::npos) {
+        for (auto& argument : arguments) {
+            user_ids.push_back(std::stoul(argument));
+        }
+    }
+    else {
+        std::ifstream file(arguments[0]);
+        if (!file) {
+            out << "[X] Could not open file " << arguments[0] << ".\n";
+            return;
+        }
+        uint32_t user_id;
+        while (file >> user_id) {
+            user_ids.push_back(user_id);
+        }
     }
+    if (threads == 0) {
+        threads = default_thread_count();
+    }
+    // The threads are started once, as the batches below would otherwise start them every time
+    WorkerPool pool(static_cast<unsigned>(std::min<size_t>(threads, std::max<size_t>(1, (user_ids.size() + 15) / 16))));
+
+    const std::vector<std::string> headers = { "user_id", "sofifa_id", "name", "global_rating", "count", "rating" };
+    const std::vector<size_t> w = { 12, 12, 50, 18, 10, 10 };
+    RowWriter rows(out);
+    rows.header(headers, w);
+    rows.flush();
+
+    // Scratch buffers are kept per thread and per batch slot, and reused across batches
+    std::vector<std::vector<Rating>> scratch(threads);
+    std::vector<RowWriter> formatters(threads);
+    std::vector<std::string> slots(std::min(batch_size, user_ids.size()));
+    auto start = std::chrono::steady_clock::now();
+
+    for (size_t first = 0; first < user_ids.size(); first += batch_size) {
+        size_t count = std::min(batch_size, user_ids.size() - first);
+        pool.run(count, [&](size_t i, unsigned t) {
+            uint32_t user_id = user_ids[first + i];
+            std::vector<Rating>& top = scratch[t];
+            RowWriter& formatter = formatters[t];
+            if (rating_store.loaded) {
+                rating_store.top_from_user(user_id, 20, top);
+            }
+            else {
+                ratings.top_from_user(user_id, 20, top);
+            }
+            formatter.clear();
+            for (auto& rating : top) {
+                const Player* player = players.search(rating.player_id);
+                formatter.cell(user_id, w[0]);
+                formatter.cell(player->id, w[1]);
+                formatter.cell(player->name, w[2]);
+                formatter.cell(player->global_rating, w[3]);
+                formatter.cell(player->rating_count, w[4]);
+                formatter.cell(rating.score, w[5]);
+                formatter.end_row();
+            }
+            slots[i] = formatter.str();
+        }, 16);
+        // Stream the batch in input order before starting the next one
+        for (size_t i = 0; i < count; i++) {
+            out << slots[i];
+        }
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    out << "\n[-] " << user_ids.size() << " users in " << elapsed.count() << " seconds ("
+        << user_ids.size() / std::max(elapsed.count(), 1e-9) << " users/s over "
+        << threads << " threads).\n";
 }
 
 /**
@@ -251,43 +1232,162 @@ void start_console(
  *
  * @param line The command line input to be parsed.
  * @param arguments A reference to a vector where the parsed arguments will be stored.
+ * @param options A reference to a map where the parsed key=value options will be stored.
  * @return The extracted command from the command line.
  */
-std::string parse_command(std::string line, std::vector<std::string>& arguments) {
+std::string parse_command(std::string line, std::vector<std::string>& arguments, CommandOptions& options) {
     std::string command;
     std::stringstream ss(line);
 
     std::getline(ss, command, ' ');
-    if (command.back() == ' ') {
+    if (!command.empty() && command.back() == ' ') {
         // Remove trailing space
         command.pop_back();
     }
 
     std::string argument;
+    bool quoted = false;
     while (std::getline(ss, argument, '\'')) {
-        // Ignore if argument is empty
-        if (argument != "" && argument != " ") {
-            arguments.push_back(argument);
+        if (quoted) {
+            // Quoted arguments are kept verbatim
+            if (argument != "") {
+                arguments.push_back(argument);
+            }
         }
+        else {
+            // Unquoted arguments are separated by spaces, and key=value words are options
+            std::stringstream words(argument);
+            std::string word;
+            while (words >> word) {
+                size_t equals = word.find('=');
+                if (equals != std::string::npos) {
+                    options[word.substr(0, equals)] = word.substr(equals + 1);
+                }
+                else {
+                    arguments.push_back(word);
+                }
+            }
+        }
+        quoted = !quoted;
     }
 
     return command;
 }
 
-template <typename T>
-void printw(T object, size_t width) {
-    std::cout << std::left << std::setw(width) << object;
+/**
+ * Reads a numeric option of a command, such as min_count=500 or min_rating=4.0.
+ *
+ * @param options The options parsed from the command line.
+ * @param key The name of the option.
+ * @param fallback The value to use when the option was not given.
+ * @return The value of the option.
+ */
+double option_value(const CommandOptions& options, std::string key, double fallback) {
+    auto it = options.find(key);
+    return it == options.end() ? fallback : std::stod(it->second);
+}
+
+/**
+ * Reads an integer option of a command, such as min_count=500 or limit=10.
+ *
+ * @param out The stream receiving the error, if any.
+ * @param options The options parsed from the command line.
+ * @param key The name of the option.
+ * @param value A reference holding the default value, which receives the value of the option.
+ * @param minimum The smallest accepted value.
+ * @param maximum The largest accepted value.
+ * @return True if the option was not given or is an integer within the bounds, false otherwise.
+ */
+bool count_option(std::ostream& out, const CommandOptions& options, const std::string& key, size_t& value,
+    size_t minimum, size_t maximum) {
+    auto it = options.find(key);
+    if (it == options.end()) {
+        return true;
+    }
+    size_t count;
+    if (!parse_count(it->second, count) || count < minimum || count > maximum) {
+        out << "[X] Invalid value for " << key << ": " << it->second << ".\n";
+        return false;
+    }
+    value = count;
+    return true;
+}
+
+/**
+ * Reads the paging options of a command: limit=<n> and after=<cursor>.
+ *
+ * @param out The stream receiving the error, if any.
+ * @param options The options parsed from the command line.
+ * @param limit A reference that receives the page size (unlimited by default, at least 1).
+ * @param cursor A reference that receives the decoded continuation cursor.
+ * @return True if the options are valid, false otherwise.
+ */
+bool page_options(std::ostream& out, const CommandOptions& options, size_t& limit, PageCursor& cursor) {
+    limit = SIZE_MAX;
+    if (!count_option(out, options, "limit", limit, 1)) {
+        return false;
+    }
+    auto after = options.find("after");
+    if (after != options.end() && (!decode_cursor(after->second, cursor) || cursor.empty())) {
+        out << "[X] Invalid cursor.\n";
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Builds the part of a cache key that identifies a page of a query.
+ *
+ * @param limit The page size.
+ * @param cursor The continuation cursor the page starts at.
+ * @return The page part of the key.
+ */
+std::string page_key(size_t limit, const PageCursor& cursor) {
+    return "|" + std::to_string(limit) + "|" + encode_cursor(cursor);
 }
 
-std::string positions_to_str(std::vector<std::string> positions) {
-    std::stringstream ss;
-    ss << "\"";
-    for (size_t i = 0; i < positions.size(); ++i) {
-        ss << positions[i];
-        if (i < positions.size() - 1) {
-            ss << ", ";
+/**
+ * Answers a query from the result cache, or computes it and caches the result.
+ *
+ * @param cache The result cache.
+ * @param key The normalized query, including its page.
+ * @param dependencies The names of the indexes the query reads.
+ * @param cursor A reference to the continuation cursor, which receives the cursor of the next page.
+ * @param compute The function computing the result (it updates the cursor itself).
+ * @return The IDs returned by the query.
+ */
+template <typename Compute>
+std::vector<uint32_t> cached_query(ResultCache& cache, const std::string& key,
+    const std::vector<std::string>& dependencies, PageCursor& cursor, Compute compute) {
+    auto start = std::chrono::steady_clock::now();
+    {
+        std::lock_guard<std::mutex> guard(cache.lock);
+        const CachedResult* cached = cache.find(key);
+        if (cached) {
+            std::vector<uint32_t> ids = cached->ids;
+            cursor = cached->cursor;
+            cache.hit_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            return ids;
         }
     }
-    ss << "\"";
-    return ss.str();
-}
\ No newline at end of file
+    // Batch mode may run queries in parallel, so the cache is only locked around its own use
+    CachedResult result;
+    result.ids = compute();
+    result.cursor = cursor;
+    std::lock_guard<std::mutex> guard(cache.lock);
+    cache.insert(key, result, dependencies);
+    cache.miss_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return result.ids;
+}
+
+/**
+ * Prints how to request the next page of a query, if there is one.
+ *
+ * @param out The stream to print to.
+ * @param cursor The continuation cursor returned by the query.
+ */
+void print_next_page(std::ostream& out, const PageCursor& cursor) {
+    if (!cursor.empty()) {
+        out << "\n[-] More results available, continue with after=" << encode_cursor(cursor) << "\n";
+    }
+}
@@ -0,0 +1,224 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Returns the number of worker threads to use when none is requested explicitly.
+ *
+ * @return The hardware concurrency, or 1 if it cannot be determined.
+ */
+inline unsigned default_thread_count() {
+    unsigned threads = std::thread::hardware_concurrency();
+    return threads ? threads : 1;
+}
+
+/**
+ * Runs a function for every index in [0, count) across a set of worker threads.
+ * Indexes are handed out dynamically in chunks, so uneven workloads still balance.
+ *
+ * @param count The number of indexes to process.
+ * @param function The function to call, as function(index, thread_number).
+ * @param threads The number of threads to use (0 uses the hardware concurrency).
+ * @param chunk The number of consecutive indexes taken by a thread at a time.
+ */
+template <class Function>
+void parallel_for(size_t count, Function function, unsigned threads = 0, size_t chunk = 1) {
+    if (threads == 0) {
+        threads = default_thread_count();
+    }
+    threads = static_cast<unsigned>(std::min<size_t>(threads, (count + chunk - 1) / chunk));
+    if (threads <= 1) {
+        for (size_t i = 0; i < count; i++) {
+            function(i, 0u);
+        }
+        return;
+    }
+
+    std::atomic<size_t> next(0);
+    auto worker = [&](unsigned thread_number) {
+        size_t begin;
+        while ((begin = next.fetch_add(chunk)) < count) {
+            size_t end = std::min(begin + chunk, count);
+            for (size_t i = begin; i < end; i++) {
+                function(i, thread_number);
+            }
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (unsigned t = 1; t < threads; t++) {
+        workers.emplace_back(worker, t);
+    }
+    worker(0);
+    for (auto& thread : workers) {
+        thread.join();
+    }
+}
+
+/**
+ * A set of worker threads that stay alive between parallel loops, for callers running
+ * many short loops in a row, which would otherwise create and join threads every time
+ * (see parallel_for). The calling thread takes part in every loop as thread 0.
+ */
+class WorkerPool {
+private:
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake;      // Signals the workers that a loop started, or that the pool stops
+    std::condition_variable finished;  // Signals the caller that every worker left the loop
+    std::function<void(unsigned)> task;
+    size_t generation = 0;  // Number of loops started, so each worker joins every loop once
+    unsigned running = 0;
+    bool stopping = false;
+
+    /**
+     * Waits for loops and takes part in each of them, until the pool is destroyed.
+     *
+     * @param thread_number The number of the worker thread (from 1).
+     */
+    void work(unsigned thread_number) {
+        size_t seen = 0;
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            wake.wait(lock, [&]() { return stopping || generation != seen; });
+            if (stopping) {
+                return;
+            }
+            seen = generation;
+            lock.unlock();
+            task(thread_number);
+            lock.lock();
+            if (--running == 0) {
+                finished.notify_one();
+            }
+        }
+    }
+
+public:
+    /**
+     * Starts the worker threads.
+     *
+     * @param threads The number of threads, including the caller (0 uses the hardware concurrency).
+     */
+    explicit WorkerPool(unsigned threads = 0) {
+        if (threads == 0) {
+            threads = default_thread_count();
+        }
+        for (unsigned t = 1; t < threads; t++) {
+            workers.emplace_back(&WorkerPool::work, this, t);
+        }
+    }
+
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& thread : workers) {
+            thread.join();
+        }
+    }
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    /**
+     * Returns the number of threads of the pool, including the caller.
+     */
+    unsigned size() const {
+        return static_cast<unsigned>(workers.size()) + 1;
+    }
+
+    /**
+     * Runs a function for every index in [0, count) on the threads of the pool, like
+     * parallel_for, and returns once every index has been processed.
+     *
+     * @param count The number of indexes to process.
+     * @param function The function to call, as function(index, thread_number).
+     * @param chunk The number of consecutive indexes taken by a thread at a time.
+     */
+    template <class Function>
+    void run(size_t count, Function function, size_t chunk = 1) {
+        if (workers.empty() || count <= chunk) {
+            for (size_t i = 0; i < count; i++) {
+                function(i, 0u);
+            }
+            return;
+        }
+
+        std::atomic<size_t> next(0);
+        auto worker = [&](unsigned thread_number) {
+            size_t begin;
+            while ((begin = next.fetch_add(chunk)) < count) {
+                size_t end = std::min(begin + chunk, count);
+                for (size_t i = begin; i < end; i++) {
+                    function(i, thread_number);
+                }
+            }
+        };
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            task = worker;
+            running = static_cast<unsigned>(workers.size());
+            generation++;
+        }
+        wake.notify_all();
+        worker(0);
+        std::unique_lock<std::mutex> lock(mutex);
+        finished.wait(lock, [&]() { return running == 0; });
+        task = nullptr;
+    }
+};
+
+/**
+ * Sorts a range in parallel: the range is split into one chunk per thread, the chunks
+ * are sorted concurrently and then merged pairwise.
+ *
+ * @param first The beginning of the range.
+ * @param last The end of the range.
+ * @param compare The comparison function (strict weak ordering).
+ * @param threads The number of threads to use (0 uses the hardware concurrency).
+ */
+template <class Iterator, class Compare>
+void parallel_sort(Iterator first, Iterator last, Compare compare, unsigned threads = 0) {
+    if (threads == 0) {
+        threads = default_thread_count();
+    }
+    size_t size = last - first;
+    size_t chunks = std::min<size_t>(threads, std::max<size_t>(1, size / 4096));
+    if (chunks <= 1) {
+        std::sort(first, last, compare);
+        return;
+    }
+
+    std::vector<size_t> bounds(chunks + 1);
+    for (size_t c = 0; c <= chunks; c++) {
+        bounds[c] = size * c / chunks;
+    }
+    parallel_for(chunks, [&](size_t c, unsigned) {
+        std::sort(first + bounds[c], first + bounds[c + 1], compare);
+    }, threads);
+
+    // Merge neighbouring sorted chunks, doubling their width on every round
+    for (size_t width = 1; width < chunks; width *= 2) {
+        size_t merges = (chunks + 2 * width - 1) / (2 * width);
+        parallel_for(merges, [&](size_t m, unsigned) {
+            size_t left = m * 2 * width;
+            size_t middle = std::min(left + width, chunks);
+            size_t right = std::min(left + 2 * width, chunks);
+            if (middle < right) {
+                std::inplace_merge(first + bounds[left], first + bounds[middle], first + bounds[right], compare);
+            }
+        }, threads);
+    }
+}
+
+#endif // PARALLEL_H
@@ -1,6 +1,9 @@
 #ifndef PLAYER_HASH_H
 #define PLAYER_HASH_H
 
+#include <algorithm>
+#include <array>
+#include <cmath>
 #include <iostream>
 #include <sstream>
 #include <vector>
@@ -9,12 +12,23 @@
 #include "hashmap.h"
 #include "ratinghashmap.h"
 
+#define RATING_BUCKETS 10    // Scores go from 0.5 to 5.0 in steps of 0.5
+#define RATING_STEP 0.5f
+
+typedef std::array<uint32_t, RATING_BUCKETS> RatingHistogram;
+
 struct Player {
     uint32_t id;
+    uint32_t index;  // Dense row number, in the order players were read
+
     std::string name;
     std::vector<std::string> positions;
+    std::string positions_text;  // The positions as printed: quoted and comma separated
     double global_rating = 0;
     uint32_t rating_count = 0;
+    float p10 = 0;
+    float median = 0;
+    float p90 = 0;
 };
 
 class PlayerHashMap : public HashMap<Player> {
@@ -25,7 +39,7 @@ private:
      * @param key The key for which to calculate the hash value (32-bit uint).
      * @return The calculated hash value (16-bit uint).
      */
-    uint32_t hash(uint32_t key) {
+    uint32_t hash(const uint32_t& key) {
         return key % table_size;
     }
 
@@ -56,6 +70,23 @@ private:
         return positions;
     }
 
+    /**
+     * Joins positions into the text printed for a player, such as "ST, LW".
+     *
+     * @param positions The positions of the player.
+     * @return The quoted, comma separated positions.
+     */
+    static std::string positions_to_text(const std::vector<std::string>& positions) {
+        std::string text = "\"";
+        for (size_t i = 0; i < positions.size(); i++) {
+            if (i > 0) {
+                text += ", ";
+            }
+            text += positions[i];
+        }
+        return text + "\"";
+    }
+
     /**
      * Checks if the ID of a Player object corresponds to a given key.
      *
@@ -63,11 +94,45 @@ private:
      * @param key The key (ID) to compare against.
      * @return True if the ID of the Player object is equal to the key, false otherwise.
      */
-    bool equal(Player item, uint32_t key) {
+    bool equal(const Player& item, const uint32_t& key) {
         return item.id == key;
     }
 
+    /**
+     * Maps a score to its histogram bucket.
+     *
+     * @param score The score of a rating.
+     * @return The bucket index, clamped to the histogram range.
+     */
+    static size_t bucket_of(float score) {
+        int bucket = static_cast<int>(score / RATING_STEP + 0.5f) - 1;
+        return static_cast<size_t>(std::min(std::max(bucket, 0), RATING_BUCKETS - 1));
+    }
+
+    /**
+     * Finds the score at a given quantile of a histogram (nearest rank).
+     *
+     * @param histogram The histogram of scores.
+     * @param count The total number of scores in the histogram.
+     * @param q The quantile, between 0 and 1.
+     * @return The score of the bucket holding the quantile.
+     */
+    static float quantile(const RatingHistogram& histogram, uint32_t count, double q) {
+        uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(q * count)));
+        uint64_t seen = 0;
+        for (size_t b = 0; b < RATING_BUCKETS; b++) {
+            seen += histogram[b];
+            if (seen >= rank) {
+                return (b + 1) * RATING_STEP;
+            }
+        }
+        return RATING_BUCKETS * RATING_STEP;
+    }
+
 public:
+    uint32_t player_count = 0;
+    std::vector<RatingHistogram> histograms;  // Score distribution of each player, by player index
+
     using HashMap<Player>::HashMap;
 
     /**
@@ -84,8 +149,24 @@ public:
 
         while (in.read_row(player.id, player.name, positions)) {
             player.positions = format_positions(positions);
+            player.positions_text = positions_to_text(player.positions);
+            player.index = player_count++;
             insert(player.id, player);
         }
+        histograms.assign(player_count, RatingHistogram());
+    }
+
+    /**
+     * Folds a single rating into a player's global rating (running mean), ratings count
+     * and score histogram.
+     *
+     * @param player The player that received the rating.
+     * @param score The score of the rating.
+     */
+    void add_rating(Player& player, float score) {
+        histograms[player.index][bucket_of(score)]++;
+        player.global_rating += (static_cast<double>(score) - player.global_rating)
+            / static_cast<double>(++player.rating_count);
     }
 
     /**
@@ -93,17 +174,65 @@ public:
      *
      * @param ratings The RatingHashMap containing user ratings data.
      */
-    void load_ratings(RatingHashMap ratings) {
+    void load_ratings(RatingHashMap& ratings) {
         for (uint32_t i = 0; i < ratings.table_size; i++) {
             for (auto& user : ratings.table[i]) {
                 for (auto& rating : user.ratings) {
-                    Player* player = search(rating.player_id);
-                    player->global_rating += (static_cast<double>(rating.score) - player->global_rating)
-                        / static_cast<double>(++player->rating_count);
+                    add_rating(*search(rating.player_id), rating.score);
                 }
             }
         }
     }
+
+    /**
+     * Streams a ratings CSV file straight into player global ratings, ratings count
+     * and score histograms, without keeping the ratings of each user in memory.
+     *
+     * @param csv_filename The path to the CSV file containing the user ratings data.
+     */
+    void aggregate_ratings_csv(std::string csv_filename) {
+        io::CSVReader<3> in(csv_filename);
+        uint32_t user_id, player_id;
+        float score;
+        Player* player = nullptr;
+
+        in.read_header(io::ignore_no_column, "user_id", "sofifa_id", "rating");
+
+        while (in.read_row(user_id, player_id, score)) {
+            if (!player || player->id != player_id) {
+                player = search(player_id);
+            }
+            if (player) {
+                add_rating(*player, score);
+            }
+        }
+    }
+
+    /**
+     * Updates the score percentiles (p10, median, p90) of a player from its histogram.
+     *
+     * @param player The player whose percentiles are to be updated.
+     */
+    void update_percentiles(Player& player) {
+        if (player.rating_count == 0) {
+            return;
+        }
+        const RatingHistogram& histogram = histograms[player.index];
+        player.p10 = quantile(histogram, player.rating_count, 0.10);
+        player.median = quantile(histogram, player.rating_count, 0.50);
+        player.p90 = quantile(histogram, player.rating_count, 0.90);
+    }
+
+    /**
+     * Updates the score percentiles of every player, after all ratings were loaded.
+     */
+    void load_percentiles() {
+        for (uint32_t i = 0; i < table_size; i++) {
+            for (auto& player : table[i]) {
+                update_percentiles(player);
+            }
+        }
+    }
 };
 
 #endif // PLAYER_HASH_H
\ No newline at end of file
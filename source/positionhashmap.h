@@ -1,75 +1,295 @@
 #ifndef POS_HASH_H
 #define POS_HASH_H
 
+#include <functional>
+#include <limits>
+#include <queue>
+#include "cursor.h"
 #include "taghashmap.h"
+#include "parallel.h"
 #include "playerhashmap.h"
+#include "rankingtree.h"
 
-class PositionHashMap : public TagHashMap {
+struct RankingKey {
+    uint32_t position;  // Position slot, so all positions can be sorted in one pass
+    double rating;
+    uint32_t player_id;
+
+    // Orders by position slot, then by descending rating, with ties broken by ascending ID
+    bool operator<(const RankingKey& other) const {
+        if (position != other.position) {
+            return position < other.position;
+        }
+        if (rating != other.rating) {
+            return rating > other.rating;
+        }
+        return player_id < other.player_id;
+    }
+};
+
+#define DEFAULT_MIN_RATING_COUNT 1000  // Ratings a player needs to be ranked, unless a query asks otherwise
+
+struct Leaderboard {
+    std::string name;
+    RankingTree ranking;
+};
+
+class LeaderboardHashMap : public HashMap<Leaderboard, std::string> {
 private:
     /**
-     * Sorts a vector in descending order by player rating using insertion sort.
+     * Calculates a hash value for the given key.
      *
-     * @param vector The vector to be sorted.
-     * @param players The PlayerHashMap containing player information.
+     * @param key The key for which to calculate the hash value (string : position).
+     * @return The calculated hash value (16-bit uint).
      */
-    void sort_descending_by_rating(std::vector<uint32_t>& vector, PlayerHashMap players) {
-        int i, j;
-        for (j = 1; j < vector.size(); j++) {
-            uint32_t key = vector[j];
-            i = j - 1;
-            double rating_key = players.search(key)->global_rating;
-            while (i >= 0 && players.search(vector[i])->global_rating < rating_key) {
-                vector[i + 1] = vector[i];
-                i--;
-            }
-            vector[i + 1] = key;
+    uint32_t hash(const std::string& key) {
+        uint32_t hash_key = 0;
+        for (const char& c : key) {
+            uint32_t i = static_cast<uint32_t>(c);
+            hash_key = (PRIME * hash_key + i) % table_size;
+        }
+        return hash_key;
+    }
+
+    /**
+     * Checks if the name of a Leaderboard object corresponds to a given key.
+     *
+     * @param leaderboard The Leaderboard object to compare.
+     * @param key The key (position name) to compare against.
+     * @return True if the name of the Leaderboard object is equal to the key, false otherwise.
+     */
+    bool equal(const Leaderboard& leaderboard, const std::string& key) {
+        return leaderboard.name == key;
+    }
+
+public:
+    using HashMap<Leaderboard, std::string>::HashMap;
+
+    /**
+     * Retrieves the leaderboard of a position, creating it if it does not exist.
+     *
+     * @param position The name of the position.
+     * @return A pointer to the leaderboard of the position.
+     */
+    Leaderboard* search_or_insert(std::string position) {
+        Leaderboard* leaderboard = search(position);
+        if (!leaderboard) {
+            Leaderboard item;
+            item.name = position;
+            insert(position, item);
+            leaderboard = search(position);
         }
+        return leaderboard;
     }
+};
 
+/**
+ * Positions of the players. Each position keeps the IDs of all its players in
+ * ascending order (as a tag), plus a live leaderboard of the same players ordered by
+ * descending rating, which can be filtered by a minimum ratings count at query time.
+ * A leaderboard of all players serves rating filters that name no position.
+ */
+class PositionHashMap : public TagHashMap {
 public:
-    PositionHashMap(uint32_t tsize) : TagHashMap(tsize) {};
+    LeaderboardHashMap leaderboards;
+    RankingTree overall;  // Leaderboard of all players, regardless of position
+
+    PositionHashMap(uint32_t tsize) : TagHashMap(tsize), leaderboards(tsize) {};
 
     /**
-     * Retrieves the top N player IDs for a given position.
+     * Retrieves the IDs of the players of a position with a rating inside a range.
      *
-     * @param n The maximum number of player IDs to retrieve.
-     * @param position The position for which to retrieve top players.
-     * @return A vector containing the top N player IDs for the given position.
+     * @param position The position of the players.
+     * @param min_rating The lowest rating to retrieve.
+     * @param max_rating The highest rating to retrieve.
+     * @param min_count The minimum ratings count of the players to retrieve.
+     * @param offset The number of matching players to skip.
+     * @param limit The maximum number of player IDs to retrieve.
+     * @return A vector containing the matching player IDs, in descending order by rating.
      */
-    std::vector<uint32_t> topn(size_t n, std::string position) {
-        TagVector* pos_ptr = search(position);
+    std::vector<uint32_t> range(std::string position, double min_rating, double max_rating,
+        uint32_t min_count, size_t offset, size_t limit) {
+        Leaderboard* leaderboard = leaderboards.search(position);
+        if (!leaderboard) {
+            return std::vector<uint32_t>();
+        }
+        return leaderboard->ranking.range(max_rating, min_rating, min_count, offset, limit);
+    }
 
-        // Return the first N elements of the vector
-        auto start = pos_ptr->vector.begin();
-        auto end = start + std::min<size_t>(n, pos_ptr->vector.size());
-        std::vector<uint32_t> players(start, end);
+    /**
+     * Retrieves the top N player IDs among several positions, one page at a time,
+     * merging their leaderboards with a heap (see for_each_top). Each page resumes
+     * the leaderboards right after the last player returned.
+     *
+     * @param n The maximum number of player IDs to retrieve over all pages.
+     * @param positions The positions for which to retrieve top players.
+     * @param min_count The minimum ratings count of the players to retrieve.
+     * @param limit The maximum number of player IDs to return in this page.
+     * @param cursor A reference to the continuation cursor (last rating, last ID and
+     *        rank): when not empty, the search resumes after it. On return it holds the
+     *        cursor of the next page, or is empty if there are no more players.
+     * @return A vector containing up to limit distinct player IDs (none if the cursor is malformed).
+     */
+    std::vector<uint32_t> topn(size_t n, const std::vector<std::string>& positions,
+        uint32_t min_count, size_t limit, PageCursor& cursor) {
+        RankingEntry start = { std::numeric_limits<double>::infinity(), 0, 0 };
+        size_t rank = 0;
+        if (!cursor.empty()) {
+            if (cursor.size() != 4) {
+                cursor.clear();
+                return {};
+            }
+            start = { read_rating(cursor, 0), cursor[2] + 1, 0 };
+            rank = cursor[3];
+        }
+        cursor.clear();
 
+        std::vector<uint32_t> players;
+        double last_rating = 0;
+        for_each_top(positions, min_count, start, [&](const RankingEntry& entry) {
+            if (rank == n) {
+                return false;
+            }
+            if (players.size() == limit) {
+                // At least one more player: the next page starts after the last one
+                if (limit > 0) {
+                    push_rating(cursor, last_rating);
+                    cursor.push_back(players.back());
+                    cursor.push_back(static_cast<uint32_t>(rank));
+                }
+                return false;
+            }
+            players.push_back(entry.player_id);
+            last_rating = entry.rating;
+            rank++;
+            return true;
+        });
         return players;
     }
 
     /**
-     * Loads player data into tags based on their positions.
+     * Visits the players of several positions from the best rating downwards, merging
+     * their leaderboards lazily with a heap, so a visit that stops after k players
+     * costs O(k log p) for p positions. A player listed under several of the positions
+     * is visited once.
+     *
+     * @param positions The positions of the players to visit.
+     * @param min_count The minimum ratings count of the players to visit.
+     * @param start The key at which to start; players ordered before it are skipped.
+     * @param function The function to call, as function(entry); returning false stops the visit.
+     */
+    template <class Function>
+    void for_each_top(const std::vector<std::string>& positions, uint32_t min_count,
+        const RankingEntry& start, Function function) {
+        std::vector<RankingTree::Cursor> cursors;
+        for (auto& position : positions) {
+            Leaderboard* leaderboard = leaderboards.search(position);
+            if (leaderboard) {
+                cursors.emplace_back(&leaderboard->ranking, min_count, start);
+            }
+        }
+
+        auto worse = [&](size_t a, size_t b) {
+            return cursors[b].entry() < cursors[a].entry();
+        };
+        std::priority_queue<size_t, std::vector<size_t>, decltype(worse)> heap(worse);
+        for (size_t c = 0; c < cursors.size(); c++) {
+            if (cursors[c].valid()) {
+                heap.push(c);
+            }
+        }
+
+        // Duplicates of a player have the same key, so they leave the heap one after the other
+        bool visited = false;
+        uint32_t last_id = 0;
+        while (!heap.empty()) {
+            size_t c = heap.top();
+            const RankingEntry& entry = cursors[c].entry();
+            if (!visited || entry.player_id != last_id) {
+                if (!function(entry)) {
+                    return;
+                }
+                visited = true;
+                last_id = entry.player_id;
+            }
+            heap.pop();
+            cursors[c].next();
+            if (cursors[c].valid()) {
+                heap.push(c);
+            }
+        }
+    }
+
+    /**
+     * Loads player data into tags based on their positions, and builds the
+     * leaderboard of every position.
      *
      * @param players The PlayerHashMap containing player data.
+     * @param threads The number of threads used for sorting (0 uses the hardware concurrency).
      */
-    void load_players(PlayerHashMap players) {
+    void load_players(PlayerHashMap& players, unsigned threads = 0) {
         // Insert players into their corresponding position vectors
-        for (int i = 0; i < players.table_size; i++) {
+        for (uint32_t i = 0; i < players.table_size; i++) {
             for (auto& player : players.table[i]) {
                 for (auto& position : player.positions) {
-                    if (player.rating_count >= 1000) {
-                        insert_player_to_tag(player.id, position);
-                    }
+                    append_player_to_tag(player.id, position);
                 }
             }
         }
-        // Sort the position vectors in descending order
-        for (int i = 0; i < table_size; i++) {
-            for (auto& positions : table[i]) {
-                sort_descending_by_rating(positions.vector, players);
+        sort_tags(threads);
+
+        // Gather the sort keys of every position once, so sorting needs no lookups
+        std::vector<std::string> slots;
+        std::vector<RankingKey> keys;
+        for (uint32_t i = 0; i < table_size; i++) {
+            for (auto& position : table[i]) {
+                position.for_each([&](uint32_t id) {
+                    keys.push_back({ static_cast<uint32_t>(slots.size()), players.search(id)->global_rating, id });
+                });
+                slots.push_back(position.name);
+                leaderboards.search_or_insert(position.name);
+            }
+        }
+
+        parallel_sort(keys.begin(), keys.end(), std::less<RankingKey>(), threads);
+
+        // Build every leaderboard bottom-up from its sorted slice of keys
+        std::vector<RankingEntry> entries;
+        size_t k = 0;
+        for (uint32_t slot = 0; slot < slots.size(); slot++) {
+            entries.clear();
+            for (; k < keys.size() && keys[k].position == slot; k++) {
+                entries.push_back({ keys[k].rating, keys[k].player_id, players.search(keys[k].player_id)->rating_count });
+            }
+            leaderboards.search(slots[slot])->ranking.build(entries);
+        }
+
+        entries.clear();
+        for (uint32_t i = 0; i < players.table_size; i++) {
+            for (auto& player : players.table[i]) {
+                entries.push_back({ player.global_rating, player.id, player.rating_count });
             }
         }
+        parallel_sort(entries.begin(), entries.end(), std::less<RankingEntry>(), threads);
+        overall.build(entries);
+    }
+
+    /**
+     * Moves a player within the leaderboards of its positions after its rating changed.
+     *
+     * @param player The player, with its rating and ratings count already updated.
+     * @param old_rating The global rating of the player before the change.
+     * @param old_count The ratings count of the player before the change.
+     */
+    void update_player(const Player& player, double old_rating, uint32_t old_count) {
+        for (auto& position : player.positions) {
+            RankingTree& ranking = leaderboards.search_or_insert(position)->ranking;
+            ranking.erase({ old_rating, player.id, old_count });
+            ranking.insert({ player.global_rating, player.id, player.rating_count });
+        }
+        overall.erase({ old_rating, player.id, old_count });
+        overall.insert({ player.global_rating, player.id, player.rating_count });
     }
 };
 
-#endif // POS_HASH_H
\ No newline at end of file
+#endif // POS_HASH_H
@@ -0,0 +1,355 @@
+#ifndef QUERY_PLANNER_H
+#define QUERY_PLANNER_H
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <limits>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "playerhashmap.h"
+#include "positionhashmap.h"
+#include "rankingtree.h"
+#include "tagquery.h"
+#include "trie.h"
+
+struct PlanStage {
+    std::string operation;  // "scan", "probe" or "sort"
+    std::string predicate;
+    std::string access;     // Index or check used by the stage
+    size_t estimate;        // Estimated rows produced (SIZE_MAX when not estimated)
+    size_t rows;            // Rows actually produced
+};
+
+/**
+ * Player query combining several predicates: a name prefix, a set of positions, a
+ * tag query and rating filters. Each predicate estimates how many players it matches
+ * from its index (trie subtree counts, posting list sizes, leaderboard ranks); the
+ * most selective one is scanned from its index, and every candidate is then probed
+ * against the others, most selective first. Results are ordered by descending rating.
+ */
+class PlayerQuery {
+private:
+    enum PredicateType { NAME, POSITION, TAGS, RATING };
+
+    struct Predicate {
+        PredicateType type;
+        std::string description;
+        size_t estimate;
+    };
+
+    bool has_name = false;
+    std::string prefix;
+    std::vector<std::string> positions;
+    bool has_tags = false;
+    std::string tags_text;
+    TagQuery tag_query;
+    bool has_rating = false;
+    double min_rating = -std::numeric_limits<double>::infinity();
+    double max_rating = std::numeric_limits<double>::infinity();
+    uint32_t min_count = 0;
+    std::string error;
+    std::vector<PlanStage> stages;
+
+    /**
+     * Estimates the selectivity of every predicate.
+     *
+     * @param player_names The PlayerNameTrie containing the player names.
+     * @param position_map The PositionHashMap containing the positions and leaderboards.
+     * @return The predicates, most selective first.
+     */
+    std::vector<Predicate> estimate(PlayerNameTrie& player_names, PositionHashMap& position_map) {
+        std::vector<Predicate> predicates;
+        if (has_name) {
+            predicates.push_back({ NAME, "name '" + prefix + "'", player_names.count(prefix) });
+        }
+        if (!positions.empty()) {
+            std::string description = "position";
+            size_t total = 0;
+            for (auto& position : positions) {
+                TagVector* tag = position_map.search(position);
+                total += tag ? tag->count() : 0;
+                description += " '" + position + "'";
+            }
+            predicates.push_back({ POSITION, description, total });
+        }
+        if (has_tags) {
+            predicates.push_back({ TAGS, "tags " + tags_text, tag_query.get_root().cost });
+        }
+        if (has_rating) {
+            std::ostringstream description;
+            description << "rating [" << min_rating << ", " << max_rating << "]";
+            if (min_count > 0) {
+                description << ", count >= " << min_count;
+            }
+            predicates.push_back({ RATING, description.str(), position_map.overall.count_range(max_rating, min_rating) });
+        }
+        std::stable_sort(predicates.begin(), predicates.end(), [](const Predicate& a, const Predicate& b) {
+            return a.estimate < b.estimate;
+        });
+        return predicates;
+    }
+
+    /**
+     * Produces the candidates of a predicate from its index, one at a time.
+     *
+     * @param predicate The predicate to scan.
+     * @param player_names The PlayerNameTrie containing the player names.
+     * @param players The PlayerHashMap containing player information.
+     * @param position_map The PositionHashMap containing the positions and leaderboards.
+     * @param function The function to call for every candidate, as function(player).
+     * @return The name of the index used.
+     */
+    template <class Function>
+    std::string scan(const Predicate& predicate, PlayerNameTrie& player_names, PlayerHashMap& players,
+        PositionHashMap& position_map, Function function) {
+        auto visit = [&](uint32_t id) {
+            const Player* player = players.search(id);
+            if (player) {
+                function(*player);
+            }
+            return true;
+        };
+        switch (predicate.type) {
+        case NAME:
+            player_names.for_each(prefix, visit);
+            return "name trie subtree";
+        case POSITION:
+            for (size_t p = 0; p < positions.size(); p++) {
+                TagVector* tag = position_map.search(positions[p]);
+                if (!tag) {
+                    continue;
+                }
+                tag->for_each([&](uint32_t id) {
+                    const Player* player = players.search(id);
+                    if (!player) {
+                        return;
+                    }
+                    // A player with several of the positions is produced by the first one
+                    for (size_t q = 0; q < p; q++) {
+                        if (std::find(player->positions.begin(), player->positions.end(), positions[q])
+                            != player->positions.end()) {
+                            return;
+                        }
+                    }
+                    function(*player);
+                });
+            }
+            return "position postings";
+        case TAGS:
+            tag_query.for_each(-1, visit);
+            return "tag postings";
+        default:
+            for (RankingTree::Cursor cursor(&position_map.overall, min_count, { max_rating, 0, 0 });
+                cursor.valid() && cursor.entry().rating >= min_rating; cursor.next()) {
+                visit(cursor.entry().player_id);
+            }
+            return "overall leaderboard range";
+        }
+    }
+
+    /**
+     * Checks a candidate against a predicate.
+     *
+     * @param predicate The predicate to check.
+     * @param player The candidate player.
+     * @return True if the player matches the predicate, false otherwise.
+     */
+    bool probe(const Predicate& predicate, const Player& player) const {
+        switch (predicate.type) {
+        case NAME:
+            return PlayerNameTrie::has_prefix(player.name, prefix);
+        case POSITION:
+            for (auto& position : player.positions) {
+                if (std::find(positions.begin(), positions.end(), position) != positions.end()) {
+                    return true;
+                }
+            }
+            return false;
+        case TAGS:
+            return tag_query.matches(player.id);
+        default:
+            return player.global_rating >= min_rating && player.global_rating <= max_rating
+                && player.rating_count >= min_count;
+        }
+    }
+
+    static const char* probe_access(PredicateType type) {
+        switch (type) {
+        case NAME: return "name prefix check";
+        case POSITION: return "player positions check";
+        case TAGS: return "tag postings probe";
+        default: return "player rating check";
+        }
+    }
+
+public:
+    /**
+     * Parses the predicates of a query, written as sections:
+     *   name '<prefix>'  position '<position>' ...  tags <tag query>
+     * Rating filters are given separately (see set_rating_filter).
+     *
+     * @param text The query text.
+     * @param tags The TagHashMap containing the tag posting lists.
+     * @return True if the query is valid, false otherwise (see get_error).
+     */
+    bool parse(const std::string& text, TagHashMap& tags) {
+        enum Section { NONE, NAME_SECTION, POSITION_SECTION, TAGS_SECTION } section = NONE;
+        size_t tags_start = 0, tags_end = 0;
+        size_t i = 0;
+        error.clear();
+        while (i < text.size()) {
+            char c = text[i];
+            if (std::isspace(static_cast<unsigned char>(c))) {
+                i++;
+                continue;
+            }
+            size_t start = i;
+            std::string token;
+            bool quoted = c == '\'';
+            if (quoted) {
+                size_t end = text.find('\'', i + 1);
+                if (end == std::string::npos) {
+                    error = "Missing closing quote.";
+                    return false;
+                }
+                token = text.substr(i + 1, end - i - 1);
+                i = end + 1;
+            }
+            else {
+                while (i < text.size() && !std::isspace(static_cast<unsigned char>(text[i])) && text[i] != '\'') {
+                    i++;
+                }
+                token = text.substr(start, i - start);
+            }
+
+            if (!quoted && (token == "name" || token == "position" || token == "positions" || token == "tags")) {
+                if ((token == "name" && has_name) || (token == "tags" && has_tags)) {
+                    error = "Repeated " + token + " predicate.";
+                    return false;
+                }
+                section = token == "name" ? NAME_SECTION : token == "tags" ? TAGS_SECTION : POSITION_SECTION;
+                if (section == TAGS_SECTION) {
+                    has_tags = true;
+                    tags_start = tags_end = i;
+                }
+                continue;
+            }
+            if (!quoted && token.find('=') != std::string::npos) {
+                // Command options, such as min_rating=4
+                continue;
+            }
+            if (section == TAGS_SECTION) {
+                tags_end = i;
+            }
+            else if (section == NAME_SECTION && quoted && !has_name) {
+                has_name = true;
+                prefix = token;
+            }
+            else if (section == POSITION_SECTION && quoted) {
+                positions.push_back(token);
+            }
+            else {
+                error = "Unexpected \"" + token + "\".";
+                return false;
+            }
+        }
+
+        if (has_tags) {
+            tags_text = text.substr(tags_start, tags_end - tags_start);
+            tags_text.erase(0, tags_text.find_first_not_of(' '));
+            if (!tag_query.parse(tags_text, tags)) {
+                error = tag_query.get_error();
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Adds a rating filter to the query.
+     *
+     * @param min_rating The lowest rating to match.
+     * @param max_rating The highest rating to match.
+     * @param min_count The minimum ratings count to match.
+     */
+    void set_rating_filter(double min_rating, double max_rating, uint32_t min_count) {
+        has_rating = true;
+        this->min_rating = min_rating;
+        this->max_rating = max_rating;
+        this->min_count = min_count;
+    }
+
+    /**
+     * Runs the query, recording the plan and the rows produced by every stage.
+     *
+     * @param player_names The PlayerNameTrie containing the player names.
+     * @param players The PlayerHashMap containing player information.
+     * @param position_map The PositionHashMap containing the positions and leaderboards.
+     * @param offset The number of matching players to skip.
+     * @param limit The maximum number of player IDs to return.
+     * @param result A reference to the vector that receives the matching player IDs,
+     *        in descending order by rating.
+     * @return True if the query ran, false if it has no predicates.
+     */
+    bool execute(PlayerNameTrie& player_names, PlayerHashMap& players, PositionHashMap& position_map,
+        size_t offset, size_t limit, std::vector<uint32_t>& result) {
+        stages.clear();
+        result.clear();
+        std::vector<Predicate> predicates = estimate(player_names, position_map);
+        if (predicates.empty()) {
+            error = "No predicates were provided.";
+            return false;
+        }
+
+        // Drive from the most selective index, probing every candidate as it is produced
+        std::vector<size_t> passed(predicates.size(), 0);
+        std::vector<const Player*> rows;
+        std::string access = scan(predicates[0], player_names, players, position_map, [&](const Player& player) {
+            passed[0]++;
+            for (size_t p = 1; p < predicates.size(); p++) {
+                if (!probe(predicates[p], player)) {
+                    return;
+                }
+                passed[p]++;
+            }
+            rows.push_back(&player);
+        });
+        stages.push_back({ "scan", predicates[0].description, access, predicates[0].estimate, passed[0] });
+        for (size_t p = 1; p < predicates.size(); p++) {
+            stages.push_back({ "probe", predicates[p].description, probe_access(predicates[p].type),
+                predicates[p].estimate, passed[p] });
+        }
+
+        // The leaderboard already yields players by rating
+        size_t end = std::min(rows.size(), offset > SIZE_MAX - limit ? SIZE_MAX : offset + limit);
+        if (predicates[0].type != RATING) {
+            std::partial_sort(rows.begin(), rows.begin() + end, rows.end(), [](const Player* a, const Player* b) {
+                return a->global_rating > b->global_rating
+                    || (a->global_rating == b->global_rating && a->id < b->id);
+            });
+            stages.push_back({ "sort", "rating descending", "partial sort", SIZE_MAX, end });
+        }
+        for (size_t r = std::min(offset, end); r < end; r++) {
+            result.push_back(rows[r]->id);
+        }
+        return true;
+    }
+
+    /**
+     * Returns the stages of the last execution.
+     */
+    const std::vector<PlanStage>& plan() const {
+        return stages;
+    }
+
+    /**
+     * Returns the reason why the last parse or execution failed.
+     */
+    const std::string& get_error() const {
+        return error;
+    }
+};
+
+#endif // QUERY_PLANNER_H
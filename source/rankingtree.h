@@ -0,0 +1,342 @@
+#ifndef RANKING_TREE_H
+#define RANKING_TREE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+#include <vector>
+
+#define NO_NODE UINT32_MAX
+
+struct RankingEntry {
+    double rating;
+    uint32_t player_id;
+    uint32_t count;
+
+    // Orders by descending rating, with ties broken by ascending ID
+    bool operator<(const RankingEntry& other) const {
+        return rating > other.rating
+            || (rating == other.rating && player_id < other.player_id);
+    }
+};
+
+/**
+ * Order-statistic tree (treap) of players ordered by descending rating. Nodes live in
+ * a single pool and refer to each other by index, and every node keeps the size of
+ * its subtree and the highest ratings count found in it, so insertions, removals and
+ * rank queries take O(log n), and players below a ratings count are skipped by subtree.
+ */
+class RankingTree {
+private:
+    struct Node {
+        RankingEntry entry;
+        uint32_t priority;
+        uint32_t left = NO_NODE;
+        uint32_t right = NO_NODE;
+        uint32_t size = 1;
+        uint32_t max_count;  // Highest ratings count in the subtree
+    };
+
+    std::vector<Node> nodes;
+    std::vector<uint32_t> free_nodes;
+    uint32_t root = NO_NODE;
+
+    /**
+     * Derives a pseudo-random heap priority from a player ID, so that the shape of
+     * the tree does not depend on insertion order.
+     *
+     * @param player_id The ID of the player.
+     * @return The priority of the node.
+     */
+    static uint32_t priority_of(uint32_t player_id) {
+        uint32_t x = player_id * 0x9E3779B1u;
+        x ^= x >> 16;
+        x *= 0x85EBCA6Bu;
+        x ^= x >> 13;
+        return x;
+    }
+
+    uint32_t size_of(uint32_t node) const {
+        return node == NO_NODE ? 0 : nodes[node].size;
+    }
+
+    uint32_t max_count_of(uint32_t node) const {
+        return node == NO_NODE ? 0 : nodes[node].max_count;
+    }
+
+    /**
+     * Recomputes the subtree data of a node from its children.
+     *
+     * @param node The node to be updated.
+     */
+    void pull(uint32_t node) {
+        nodes[node].size = 1 + size_of(nodes[node].left) + size_of(nodes[node].right);
+        nodes[node].max_count = std::max(nodes[node].entry.count,
+            std::max(max_count_of(nodes[node].left), max_count_of(nodes[node].right)));
+    }
+
+    uint32_t new_node(const RankingEntry& entry) {
+        Node node;
+        node.entry = entry;
+        node.priority = priority_of(entry.player_id);
+        node.max_count = entry.count;
+        if (!free_nodes.empty()) {
+            uint32_t index = free_nodes.back();
+            free_nodes.pop_back();
+            nodes[index] = node;
+            return index;
+        }
+        nodes.push_back(node);
+        return static_cast<uint32_t>(nodes.size() - 1);
+    }
+
+    /**
+     * Splits a subtree into the entries ordered before a key and the remaining ones.
+     *
+     * @param node The root of the subtree.
+     * @param key The key at which to split.
+     * @param left A reference that receives the root of the entries before the key.
+     * @param right A reference that receives the root of the remaining entries.
+     */
+    void split(uint32_t node, const RankingEntry& key, uint32_t& left, uint32_t& right) {
+        if (node == NO_NODE) {
+            left = right = NO_NODE;
+            return;
+        }
+        if (nodes[node].entry < key) {
+            split(nodes[node].right, key, nodes[node].right, right);
+            left = node;
+        }
+        else {
+            split(nodes[node].left, key, left, nodes[node].left);
+            right = node;
+        }
+        pull(node);
+    }
+
+    /**
+     * Joins two subtrees, where every entry of the first is ordered before the second.
+     *
+     * @param left The root of the first subtree.
+     * @param right The root of the second subtree.
+     * @return The root of the joined tree.
+     */
+    uint32_t merge(uint32_t left, uint32_t right) {
+        if (left == NO_NODE || right == NO_NODE) {
+            return left == NO_NODE ? right : left;
+        }
+        if (nodes[left].priority > nodes[right].priority) {
+            nodes[left].right = merge(nodes[left].right, right);
+            pull(left);
+            return left;
+        }
+        nodes[right].left = merge(left, nodes[right].left);
+        pull(right);
+        return right;
+    }
+
+public:
+    /**
+     * In-order cursor over the tree, yielding entries from the best rating downwards.
+     * Subtrees without any player with the minimum ratings count are skipped whole.
+     * The tree must not be modified while a cursor is in use.
+     */
+    class Cursor {
+    private:
+        const RankingTree* tree;
+        uint32_t min_count;
+        std::vector<uint32_t> stack;
+
+        void descend(uint32_t node) {
+            while (node != NO_NODE && tree->nodes[node].max_count >= min_count) {
+                stack.push_back(node);
+                node = tree->nodes[node].left;
+            }
+        }
+
+        // Moves past nodes that only lead to qualifying players in their right subtree
+        void settle() {
+            while (!stack.empty() && tree->nodes[stack.back()].entry.count < min_count) {
+                uint32_t node = stack.back();
+                stack.pop_back();
+                descend(tree->nodes[node].right);
+            }
+        }
+
+    public:
+        Cursor(const RankingTree* tree, uint32_t min_count = 0) : tree(tree), min_count(min_count) {
+            descend(tree->root);
+            settle();
+        }
+
+        /**
+         * Creates a cursor positioned at the first entry that is not ordered before a key.
+         *
+         * @param tree The tree to traverse.
+         * @param min_count The minimum ratings count of the entries to yield.
+         * @param start The key at which to start.
+         */
+        Cursor(const RankingTree* tree, uint32_t min_count, const RankingEntry& start)
+            : tree(tree), min_count(min_count) {
+            uint32_t node = tree->root;
+            while (node != NO_NODE && tree->nodes[node].max_count >= min_count) {
+                if (tree->nodes[node].entry < start) {
+                    node = tree->nodes[node].right;
+                }
+                else {
+                    stack.push_back(node);
+                    node = tree->nodes[node].left;
+                }
+            }
+            settle();
+        }
+
+        bool valid() const {
+            return !stack.empty();
+        }
+
+        const RankingEntry& entry() const {
+            return tree->nodes[stack.back()].entry;
+        }
+
+        void next() {
+            uint32_t node = stack.back();
+            stack.pop_back();
+            descend(tree->nodes[node].right);
+            settle();
+        }
+    };
+
+    /**
+     * Replaces the contents of the tree with entries that are already in order,
+     * building it bottom-up in O(n).
+     *
+     * @param entries The entries, sorted by descending rating.
+     */
+    void build(const std::vector<RankingEntry>& entries) {
+        nodes.clear();
+        free_nodes.clear();
+        std::vector<uint32_t> spine;  // Right spine of the tree built so far
+        for (auto& entry : entries) {
+            uint32_t node = new_node(entry);
+            uint32_t last = NO_NODE;
+            while (!spine.empty() && nodes[spine.back()].priority < nodes[node].priority) {
+                last = spine.back();
+                spine.pop_back();
+                pull(last);
+            }
+            nodes[node].left = last;
+            if (!spine.empty()) {
+                nodes[spine.back()].right = node;
+            }
+            spine.push_back(node);
+        }
+        while (!spine.empty()) {
+            pull(spine.back());
+            root = spine.back();
+            spine.pop_back();
+        }
+        if (entries.empty()) {
+            root = NO_NODE;
+        }
+    }
+
+    /**
+     * Inserts a player into the tree.
+     *
+     * @param entry The rating, ID and ratings count of the player.
+     */
+    void insert(const RankingEntry& entry) {
+        uint32_t left, right;
+        split(root, entry, left, right);
+        root = merge(merge(left, new_node(entry)), right);
+    }
+
+    /**
+     * Removes a player from the tree.
+     *
+     * @param entry The rating and ID under which the player was inserted.
+     * @return True if the player was found and removed, false otherwise.
+     */
+    bool erase(const RankingEntry& entry) {
+        uint32_t left, middle, right;
+        split(root, entry, left, right);
+        RankingEntry after = { entry.rating, entry.player_id + 1, 0 };
+        split(right, after, middle, right);
+        bool found = middle != NO_NODE;
+        if (found) {
+            free_nodes.push_back(middle);
+        }
+        root = merge(left, right);
+        return found;
+    }
+
+    /**
+     * Retrieves the IDs of the players with a rating inside a range, in descending
+     * order by rating, in O(log n + k) for k visited players.
+     *
+     * @param max_rating The highest rating to retrieve.
+     * @param min_rating The lowest rating to retrieve.
+     * @param min_count The minimum ratings count of the players to retrieve.
+     * @param offset The number of matching players to skip.
+     * @param limit The maximum number of player IDs to retrieve.
+     * @return A vector containing up to limit player IDs.
+     */
+    std::vector<uint32_t> range(double max_rating, double min_rating, uint32_t min_count,
+        size_t offset, size_t limit) const {
+        std::vector<uint32_t> players;
+        Cursor cursor(this, min_count, { max_rating, 0, 0 });
+        for (; cursor.valid() && cursor.entry().rating >= min_rating && players.size() < limit; cursor.next()) {
+            if (offset > 0) {
+                offset--;
+                continue;
+            }
+            players.push_back(cursor.entry().player_id);
+        }
+        return players;
+    }
+
+    /**
+     * Counts the players ordered before a key, in O(log n).
+     *
+     * @param key The key to compare against.
+     * @return The number of entries ordered before the key.
+     */
+    size_t count_before(const RankingEntry& key) const {
+        size_t count = 0;
+        uint32_t node = root;
+        while (node != NO_NODE) {
+            if (nodes[node].entry < key) {
+                count += size_of(nodes[node].left) + 1;
+                node = nodes[node].right;
+            }
+            else {
+                node = nodes[node].left;
+            }
+        }
+        return count;
+    }
+
+    /**
+     * Counts the players with a rating inside a range, in O(log n).
+     *
+     * @param max_rating The highest rating to count.
+     * @param min_rating The lowest rating to count.
+     * @return The number of players inside the range.
+     */
+    size_t count_range(double max_rating, double min_rating) const {
+        if (min_rating > max_rating) {
+            return 0;
+        }
+        return count_before({ min_rating, UINT32_MAX, 0 }) - count_before({ max_rating, 0, 0 });
+    }
+
+    /**
+     * Returns the number of players in the tree.
+     */
+    size_t size() const {
+        return size_of(root);
+    }
+};
+
+#endif // RANKING_TREE_H
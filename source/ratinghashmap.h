@@ -32,7 +32,7 @@ private:
      * @param key The key for which to calculate the hash value (32-bit uint).
      * @return The calculated hash value (16-bit uint).
      */
-    uint32_t hash(uint32_t key) {
+    uint32_t hash(const uint32_t& key) {
         return key % table_size;
     }
 
@@ -43,52 +43,32 @@ private:
      * @param key The key (ID) to compare against.
      * @return True if the ID of the User object is equal to the key, false otherwise.
      */
-    bool equal(User user, uint32_t key) {
+    bool equal(const User& user, const uint32_t& key) {
         return user.id == key;
     }
 
-    /**
-     * Sorts a vector in descending order using insertion sort.
-     *
-     * @param vector The vector to be sorted.
-     */
-    void sort_descending(std::vector<Rating>& vector) {
-        int i, j;
-        for (j = 1; j < vector.size(); j++) {
-            Rating key = vector[j];
-            i = j - 1;
-            while (i >= 0 && vector[i] < key) {
-                vector[i + 1] = vector[i];
-                i--;
-            }
-            vector[i + 1] = key;
-        }
-    }
-
 public:
+    bool loaded = false;
+
     using HashMap<User>::HashMap;
 
     /**
-     * Retrieves the top 20 ratings from a user's ratings.
+     * Retrieves the top N ratings from a user's ratings without reordering them,
+     * so it may be called concurrently from several threads.
      *
      * @param user_id The ID of the user whose ratings are to be retrieved.
-     * @return A vector containing the top 20 ratings from the user.
+     * @param n The maximum number of ratings to retrieve.
+     * @param top A reference to the vector that receives the ratings (reused between calls).
      */
-    std::vector<Rating> top20_from_user(uint32_t user_id) {
+    void top_from_user(uint32_t user_id, size_t n, std::vector<Rating>& top) {
         User* user_ptr = search(user_id);
         if (!user_ptr) {
-            // User not found, returning empty vector
-            return std::vector<Rating>();
+            top.clear();
+            return;
         }
-
-        // Sort the ratings vector in descending order
-        sort_descending(user_ptr->ratings);
-
-        // Return the first 20 elements of the vector
-        auto start = user_ptr->ratings.begin();
-        auto end = start + std::min<size_t>(20, user_ptr->ratings.size());
-        std::vector<Rating> ratings(start, end);
-        return ratings;
+        top.resize(std::min(n, user_ptr->ratings.size()));
+        std::partial_sort_copy(user_ptr->ratings.begin(), user_ptr->ratings.end(), top.begin(), top.end(),
+            [](const Rating& a, const Rating& b) { return b < a; });
     }
 
     /*
@@ -111,6 +91,20 @@ public:
         user_ptr->ratings.push_back(rating);
     }
 
+    /**
+     * Calls a function with the ratings of every user, as a [begin, end) range.
+     *
+     * @param function The function to call, as function(begin, end).
+     */
+    template <class Function>
+    void for_each_user(Function function) {
+        for (uint32_t i = 0; i < table_size; i++) {
+            for (auto& user : table[i]) {
+                function(user.ratings.data(), user.ratings.data() + user.ratings.size());
+            }
+        }
+    }
+
     /**
      * Populates the TagHashMap by reading and parsing data from a CSV file.
      *
@@ -126,6 +120,7 @@ public:
         while (in.read_row(user_id, rating.player_id, rating.score)) {
             insert_rating_to_user(rating, user_id);
         }
+        loaded = true;
     }
 };
 
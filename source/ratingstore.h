@@ -0,0 +1,407 @@
+#ifndef RATING_STORE_H
+#define RATING_STORE_H
+
+#include <algorithm>
+#include <cstdio>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "csv.h"
+#include "playerhashmap.h"
+#include "ratinghashmap.h"
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define CSV_READER_BYTES ((3 << 20) + (256 << 10))  // Block buffer of io::LineReader and its reading thread
+
+struct RatingRecord {
+    uint32_t user_id;
+    Rating rating;
+
+    // Orders by user, and then each user's ratings in descending order
+    bool operator<(const RatingRecord& other) const {
+        return user_id < other.user_id
+            || (user_id == other.user_id && other.rating < rating);
+    }
+};
+
+struct UserExtent {
+    uint32_t user_id;
+    uint32_t count;
+    uint64_t offset;  // Position of the user's first rating in the mapped file
+};
+
+/**
+ * Out-of-core ratings index. The ratings CSV is streamed into sorted runs that fit in
+ * a memory budget, the runs are merged into a single user-major file (CSR layout)
+ * and that file is memory mapped. Only the per-user extents are kept on the heap.
+ */
+class ExternalRatingStore {
+private:
+    std::string data_filename;
+    std::vector<UserExtent> extents;
+    const Rating* data = nullptr;
+    size_t data_size = 0;
+    std::unordered_map<uint32_t, std::vector<Rating>> added;  // Ratings recorded after the build, in descending order
+#ifdef _WIN32
+    HANDLE file_handle = INVALID_HANDLE_VALUE;
+    HANDLE mapping_handle = NULL;
+#endif
+
+    /**
+     * Writes records to a file, failing loudly when the disk is full.
+     *
+     * @param data The records to write.
+     * @param size The size of a record, in bytes.
+     * @param count The number of records.
+     * @param file The file to write to.
+     * @param filename The path of the file, for the error message.
+     */
+    static void write_records(const void* data, size_t size, size_t count, std::FILE* file, const std::string& filename) {
+        if (std::fwrite(data, size, count, file) != count) {
+            std::fclose(file);
+            throw std::runtime_error("Can not write to file \"" + filename + "\".");
+        }
+    }
+
+    /**
+     * Closes a written file, failing loudly when its last buffered records can not be written.
+     *
+     * @param file The file to close.
+     * @param filename The path of the file, for the error message.
+     */
+    static void close_records(std::FILE* file, const std::string& filename) {
+        if (std::fclose(file) != 0) {
+            throw std::runtime_error("Can not write to file \"" + filename + "\".");
+        }
+    }
+
+    /**
+     * Sorts a run of records and writes it to a temporary file.
+     *
+     * @param run The records of the run.
+     * @param filename The path of the file to be written.
+     * @return The number of distinct users in the run.
+     */
+    size_t spill_run(std::vector<RatingRecord>& run, const std::string& filename) {
+        std::sort(run.begin(), run.end());
+        std::FILE* file = std::fopen(filename.c_str(), "wb");
+        if (!file) {
+            throw std::runtime_error("Can not create run file \"" + filename + "\".");
+        }
+        write_records(run.data(), sizeof(RatingRecord), run.size(), file, filename);
+        close_records(file, filename);
+        size_t users = 0;
+        for (size_t i = 0; i < run.size(); i++) {
+            users += i == 0 || run[i].user_id != run[i - 1].user_id;
+        }
+        run.clear();
+        return users;
+    }
+
+    /**
+     * Builds a unique path for a temporary file, so several processes can share the directory.
+     *
+     * @param directory The directory of the file.
+     * @param name The name of the file, without the unique part.
+     * @return The path of the file.
+     */
+    static std::string temp_filename(const std::string& directory, const std::string& name) {
+#ifdef _WIN32
+        unsigned long id = GetCurrentProcessId();
+#else
+        unsigned long id = static_cast<unsigned long>(getpid());
+#endif
+        return directory + "/" + name + "." + std::to_string(id);
+    }
+
+    /**
+     * Merges the sorted run files into the user-major data file, filling the extents.
+     *
+     * @param run_filenames The paths of the run files.
+     * @param buffer_records The number of records that may be buffered in total.
+     * @param run_records The number of records of the largest run.
+     */
+    void merge_runs(const std::vector<std::string>& run_filenames, size_t buffer_records, size_t run_records) {
+        struct RunCursor {
+            std::FILE* file = nullptr;
+            std::vector<RatingRecord> buffer;
+            size_t position = 0;
+            size_t size = 0;
+
+            // Closes the run when the merge fails, so its file can be removed
+            ~RunCursor() {
+                if (file) {
+                    std::fclose(file);
+                }
+            }
+
+            bool refill() {
+                size = std::fread(buffer.data(), sizeof(RatingRecord), buffer.size(), file);
+                position = 0;
+                return size > 0;
+            }
+        };
+
+        size_t per_run = std::max<size_t>(1, buffer_records / (run_filenames.size() + 1));
+        per_run = std::min(per_run, run_records);
+        std::vector<RunCursor> cursors(run_filenames.size());
+        auto greater = [&](size_t a, size_t b) {
+            return cursors[b].buffer[cursors[b].position] < cursors[a].buffer[cursors[a].position];
+        };
+        std::priority_queue<size_t, std::vector<size_t>, decltype(greater)> heap(greater);
+
+        for (size_t r = 0; r < run_filenames.size(); r++) {
+            cursors[r].file = std::fopen(run_filenames[r].c_str(), "rb");
+            if (!cursors[r].file) {
+                throw std::runtime_error("Can not open run file \"" + run_filenames[r] + "\".");
+            }
+            cursors[r].buffer.resize(per_run);
+            if (cursors[r].refill()) {
+                heap.push(r);
+            }
+        }
+
+        std::FILE* out = std::fopen(data_filename.c_str(), "wb");
+        if (!out) {
+            throw std::runtime_error("Can not create ratings file \"" + data_filename + "\".");
+        }
+        std::vector<Rating> output;
+        output.reserve(per_run);
+        uint64_t written = 0;
+
+        while (!heap.empty()) {
+            size_t r = heap.top();
+            heap.pop();
+            const RatingRecord& record = cursors[r].buffer[cursors[r].position];
+
+            if (extents.empty() || extents.back().user_id != record.user_id) {
+                extents.push_back({ record.user_id, 0, written });
+            }
+            extents.back().count++;
+            output.push_back(record.rating);
+            written++;
+            if (output.size() == per_run) {
+                write_records(output.data(), sizeof(Rating), output.size(), out, data_filename);
+                output.clear();
+            }
+
+            if (++cursors[r].position < cursors[r].size || cursors[r].refill()) {
+                heap.push(r);
+            }
+        }
+        write_records(output.data(), sizeof(Rating), output.size(), out, data_filename);
+        close_records(out, data_filename);
+
+        for (size_t r = 0; r < run_filenames.size(); r++) {
+            std::fclose(cursors[r].file);
+            cursors[r].file = nullptr;
+            std::remove(run_filenames[r].c_str());
+        }
+    }
+
+    /**
+     * Maps the data file into memory (read-only).
+     */
+    void map_data() {
+        data_size = 0;
+        for (auto& extent : extents) {
+            data_size += extent.count;
+        }
+        if (data_size == 0) {
+            return;
+        }
+#ifdef _WIN32
+        file_handle = CreateFileA(data_filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        mapping_handle = CreateFileMappingA(file_handle, NULL, PAGE_READONLY, 0, 0, NULL);
+        void* address = mapping_handle ? MapViewOfFile(mapping_handle, FILE_MAP_READ, 0, 0, 0) : NULL;
+        if (!address) {
+            throw std::runtime_error("Can not map ratings file \"" + data_filename + "\".");
+        }
+#else
+        int fd = open(data_filename.c_str(), O_RDONLY);
+        void* address = fd < 0 ? MAP_FAILED
+            : mmap(nullptr, data_size * sizeof(Rating), PROT_READ, MAP_SHARED, fd, 0);
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (address == MAP_FAILED) {
+            throw std::runtime_error("Can not map ratings file \"" + data_filename + "\".");
+        }
+#endif
+        data = static_cast<const Rating*>(address);
+    }
+
+    /**
+     * Finds the extent of a user in the index.
+     *
+     * @param user_id The ID of the user.
+     * @return A pointer to the user's extent, or nullptr if not found.
+     */
+    const UserExtent* find(uint32_t user_id) {
+        auto it = std::lower_bound(extents.begin(), extents.end(), user_id,
+            [](const UserExtent& extent, uint32_t id) { return extent.user_id < id; });
+        if (it == extents.end() || it->user_id != user_id) {
+            return nullptr;
+        }
+        return &(*it);
+    }
+
+public:
+    bool loaded = false;
+    size_t run_count = 0;
+
+    /**
+     * Builds the store from a ratings CSV file, also folding every rating into the
+     * player aggregates while streaming. The budget covers what the build allocates:
+     * the CSV reader and the run buffer while the runs are written, then the user
+     * index and the merge buffers. Pages of the mapped file are not counted.
+     *
+     * @param csv_filename The path to the CSV file containing the user ratings data.
+     * @param memory_budget The number of bytes the build may allocate.
+     * @param temp_directory The directory where run files and the data file are written.
+     * @param players The PlayerHashMap into which the aggregates are loaded.
+     * @throws std::exception If a file can not be read or written; the temporary files
+     *         written so far are removed.
+     */
+    void from_csv(std::string csv_filename, size_t memory_budget, std::string temp_directory, PlayerHashMap& players) {
+        data_filename = temp_filename(temp_directory, "ratings.csr");
+        size_t run_bytes = memory_budget > CSV_READER_BYTES ? memory_budget - CSV_READER_BYTES : 0;
+        size_t buffer_records = std::max<size_t>(1024, run_bytes / sizeof(RatingRecord));
+
+        std::vector<std::string> run_filenames;
+        try {
+            size_t run_records = 0;
+            size_t user_bound = 0;  // Sum of the users of every run, at least the number of users
+            {
+                io::CSVReader<3> in(csv_filename);
+                RatingRecord record;
+                std::vector<RatingRecord> run;
+                Player* player = nullptr;
+                run.reserve(buffer_records);
+
+                in.read_header(io::ignore_no_column, "user_id", "sofifa_id", "rating");
+
+                while (in.read_row(record.user_id, record.rating.player_id, record.rating.score)) {
+                    if (!player || player->id != record.rating.player_id) {
+                        player = players.search(record.rating.player_id);
+                    }
+                    if (player) {
+                        players.add_rating(*player, record.rating.score);
+                    }
+                    run.push_back(record);
+                    if (run.size() == buffer_records) {
+                        run_records = buffer_records;
+                        run_filenames.push_back(temp_filename(temp_directory, "ratings.run" + std::to_string(run_filenames.size())));
+                        user_bound += spill_run(run, run_filenames.back());
+                    }
+                }
+                run_records = std::max(run_records, run.size());
+                if (!run.empty()) {
+                    run_filenames.push_back(temp_filename(temp_directory, "ratings.run" + std::to_string(run_filenames.size())));
+                    user_bound += spill_run(run, run_filenames.back());
+                }
+            }
+            run_count = run_filenames.size();
+
+            // The reader and the run buffer are released; the index now shares the budget with the merge
+            extents.reserve(user_bound);
+            size_t index_bytes = user_bound * sizeof(UserExtent);
+            size_t merge_bytes = memory_budget > index_bytes ? memory_budget - index_bytes : 0;
+            merge_runs(run_filenames, merge_bytes / sizeof(RatingRecord), run_records);
+            if (extents.capacity() > 2 * extents.size()) {
+                extents.shrink_to_fit();
+            }
+            map_data();
+            loaded = true;
+        }
+        catch (...) {
+            // Leave no temporary files behind: the caller reports the error
+            for (auto& run_filename : run_filenames) {
+                std::remove(run_filename.c_str());
+            }
+            std::remove(data_filename.c_str());
+            throw;
+        }
+    }
+
+    /**
+     * Retrieves the top N ratings from a user's ratings.
+     *
+     * @param user_id The ID of the user whose ratings are to be retrieved.
+     * @param n The maximum number of ratings to retrieve.
+     * @param top A reference to the vector that receives the ratings (reused between calls).
+     */
+    void top_from_user(uint32_t user_id, size_t n, std::vector<Rating>& top) {
+        const UserExtent* extent = find(user_id);
+        top.clear();
+        if (extent) {
+            // Ratings were stored in descending order during the merge
+            const Rating* start = data + extent->offset;
+            top.assign(start, start + std::min<size_t>(n, extent->count));
+        }
+        auto it = added.find(user_id);
+        if (it != added.end()) {
+            std::vector<Rating> merged(top.size() + it->second.size());
+            std::merge(top.begin(), top.end(), it->second.begin(), it->second.end(), merged.begin(),
+                [](const Rating& a, const Rating& b) { return b < a; });
+            merged.resize(std::min(n, merged.size()));
+            top.swap(merged);
+        }
+    }
+
+    /**
+     * Records a rating given after the store was built. The data file is not
+     * rewritten: the rating is kept in memory and merged into the user's ratings.
+     *
+     * @param rating The rating to be recorded.
+     * @param user_id The user who gave the rating.
+     */
+    void insert_rating_to_user(Rating rating, uint32_t user_id) {
+        std::vector<Rating>& ratings = added[user_id];
+        ratings.insert(std::upper_bound(ratings.begin(), ratings.end(), rating,
+            [](const Rating& a, const Rating& b) { return b < a; }), rating);
+    }
+
+    /**
+     * Returns the number of bytes of the in-memory user index.
+     */
+    size_t index_bytes() {
+        return extents.capacity() * sizeof(UserExtent);
+    }
+
+    /**
+     * Returns the number of bytes of the memory mapped ratings file.
+     */
+    size_t mapped_bytes() {
+        return data_size * sizeof(Rating);
+    }
+
+    ~ExternalRatingStore() {
+        if (data) {
+#ifdef _WIN32
+            UnmapViewOfFile(data);
+            CloseHandle(mapping_handle);
+            CloseHandle(file_handle);
+#else
+            munmap(const_cast<Rating*>(data), data_size * sizeof(Rating));
+#endif
+        }
+        if (loaded) {
+            std::remove(data_filename.c_str());
+        }
+    }
+};
+
+#endif // RATING_STORE_H
@@ -0,0 +1,155 @@
+#ifndef RESULT_CACHE_H
+#define RESULT_CACHE_H
+
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "cursor.h"
+
+#define DEFAULT_CACHE_ENTRIES 1024
+
+struct CachedResult {
+    std::vector<uint32_t> ids;
+    PageCursor cursor;  // Continuation cursor returned with the page
+};
+
+/**
+ * Bounded LRU cache of query results, keyed on a normalized form of the query.
+ * Every entry names the indexes it was computed from (its dependencies, such as
+ * "tags" or "position:ST"). Invalidating a dependency bumps its generation, and
+ * entries computed under an older generation are dropped the next time they are
+ * looked up, so invalidation is O(1) regardless of the number of entries.
+ */
+class ResultCache {
+private:
+    struct Entry {
+        std::string key;
+        CachedResult result;
+        std::vector<std::pair<std::string, uint64_t>> dependencies;  // Name and generation
+    };
+
+    size_t capacity;
+    std::list<Entry> entries;  // Most recently used first
+    std::unordered_map<std::string, std::list<Entry>::iterator> index;
+    std::unordered_map<std::string, uint64_t> generations;
+
+    /**
+     * Checks whether the indexes an entry was computed from are unchanged.
+     *
+     * @param entry The entry to check.
+     * @return True if the entry is still valid, false otherwise.
+     */
+    bool current(const Entry& entry) {
+        for (auto& dependency : entry.dependencies) {
+            auto it = generations.find(dependency.first);
+            if (it != generations.end() && it->second != dependency.second) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+public:
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    uint64_t invalidations = 0;  // Entries dropped because a dependency changed
+    double hit_seconds = 0;      // Time spent answering hits, as measured by the caller
+    double miss_seconds = 0;     // Time spent answering misses, as measured by the caller
+    std::mutex lock;             // Held by callers while using the cache, when threads share it
+
+    ResultCache(size_t capacity = DEFAULT_CACHE_ENTRIES) : capacity(capacity) {}
+
+    /**
+     * Looks up the result of a query, marking it as the most recently used.
+     *
+     * @param key The normalized query.
+     * @return A pointer to the cached result, or nullptr on a miss.
+     */
+    const CachedResult* find(const std::string& key) {
+        auto it = index.find(key);
+        if (it == index.end()) {
+            misses++;
+            return nullptr;
+        }
+        if (!current(*it->second)) {
+            entries.erase(it->second);
+            index.erase(it);
+            invalidations++;
+            misses++;
+            return nullptr;
+        }
+        entries.splice(entries.begin(), entries, it->second);
+        hits++;
+        return &entries.front().result;
+    }
+
+    /**
+     * Stores the result of a query, evicting the least recently used entry when full.
+     *
+     * @param key The normalized query.
+     * @param result The result of the query.
+     * @param dependencies The names of the indexes the result was computed from.
+     */
+    void insert(const std::string& key, const CachedResult& result, const std::vector<std::string>& dependencies) {
+        if (capacity == 0) {
+            return;
+        }
+        auto it = index.find(key);
+        if (it != index.end()) {
+            entries.erase(it->second);
+            index.erase(it);
+        }
+        else if (entries.size() == capacity) {
+            index.erase(entries.back().key);
+            entries.pop_back();
+            evictions++;
+        }
+        Entry entry = { key, result, {} };
+        for (auto& dependency : dependencies) {
+            entry.dependencies.push_back({ dependency, generations[dependency] });
+        }
+        entries.push_front(std::move(entry));
+        index[key] = entries.begin();
+    }
+
+    /**
+     * Invalidates every result computed from an index.
+     *
+     * @param dependency The name of the index that changed.
+     */
+    void invalidate(const std::string& dependency) {
+        generations[dependency]++;
+    }
+
+    /**
+     * Removes every entry and resets the statistics.
+     */
+    void clear() {
+        entries.clear();
+        index.clear();
+        hits = misses = evictions = invalidations = 0;
+        hit_seconds = miss_seconds = 0;
+    }
+
+    /**
+     * Returns the fraction of lookups that were hits.
+     */
+    double hit_rate() const {
+        return hits + misses == 0 ? 0 : double(hits) / double(hits + misses);
+    }
+
+    size_t size() const {
+        return entries.size();
+    }
+
+    size_t get_capacity() const {
+        return capacity;
+    }
+};
+
+#endif // RESULT_CACHE_H
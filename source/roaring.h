@@ -0,0 +1,396 @@
+#ifndef ROARING_H
+#define ROARING_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <vector>
+
+// Highest cardinality stored as a sorted array, denser chunks use a bitmap
+#define ARRAY_CONTAINER_MAX 4096
+#define BITMAP_WORDS 1024
+
+/**
+ * Compressed bitmap of 32-bit IDs (Roaring layout). IDs are split in chunks by their
+ * high 16 bits, and each chunk keeps its low 16 bits either as a sorted array (up to
+ * 4096 IDs) or as a 65536-bit bitmap, whichever is smaller. Set operations work chunk
+ * by chunk, a 64-bit word at a time on bitmaps.
+ */
+class RoaringBitmap {
+private:
+    struct Container {
+        uint16_t key;
+        uint32_t cardinality = 0;
+        std::vector<uint16_t> array;  // Sorted low bits, when not a bitmap
+        std::vector<uint64_t> bits;   // BITMAP_WORDS words, when a bitmap
+
+        bool is_bitmap() const {
+            return !bits.empty();
+        }
+
+        bool contains(uint16_t low) const {
+            if (is_bitmap()) {
+                return (bits[low >> 6] >> (low & 63)) & 1;
+            }
+            return std::binary_search(array.begin(), array.end(), low);
+        }
+
+        /**
+         * Switches to the smaller representation for the current cardinality.
+         */
+        void normalize() {
+            if (is_bitmap() && cardinality <= ARRAY_CONTAINER_MAX) {
+                array.clear();
+                array.reserve(cardinality);
+                for (uint32_t w = 0; w < BITMAP_WORDS; w++) {
+                    for (uint64_t word = bits[w]; word; word &= word - 1) {
+                        array.push_back(static_cast<uint16_t>(w * 64 + __builtin_ctzll(word)));
+                    }
+                }
+                std::vector<uint64_t>().swap(bits);
+            }
+            else if (!is_bitmap() && cardinality > ARRAY_CONTAINER_MAX) {
+                bits.assign(BITMAP_WORDS, 0);
+                for (auto& low : array) {
+                    bits[low >> 6] |= uint64_t(1) << (low & 63);
+                }
+                std::vector<uint16_t>().swap(array);
+            }
+        }
+
+        /**
+         * Recounts the cardinality of a bitmap container after a word-wise operation.
+         */
+        void count_bits() {
+            cardinality = 0;
+            for (auto& word : bits) {
+                cardinality += __builtin_popcountll(word);
+            }
+        }
+    };
+
+    std::vector<Container> containers;  // Ordered by key
+
+    static uint16_t high(uint32_t id) {
+        return static_cast<uint16_t>(id >> 16);
+    }
+
+    static uint16_t low(uint32_t id) {
+        return static_cast<uint16_t>(id & 0xFFFF);
+    }
+
+    static Container intersect(const Container& a, const Container& b) {
+        Container result;
+        result.key = a.key;
+        if (a.is_bitmap() && b.is_bitmap()) {
+            result.bits.resize(BITMAP_WORDS);
+            for (uint32_t w = 0; w < BITMAP_WORDS; w++) {
+                result.bits[w] = a.bits[w] & b.bits[w];
+            }
+            result.count_bits();
+            result.normalize();
+        }
+        else if (a.is_bitmap() || b.is_bitmap()) {
+            const Container& array = a.is_bitmap() ? b : a;
+            const Container& bitmap = a.is_bitmap() ? a : b;
+            for (auto& value : array.array) {
+                if (bitmap.contains(value)) {
+                    result.array.push_back(value);
+                }
+            }
+            result.cardinality = static_cast<uint32_t>(result.array.size());
+        }
+        else {
+            // Branch-free merge: dense arrays match about half of the time, which
+            // defeats branch prediction
+            result.array.resize(std::min(a.array.size(), b.array.size()));
+            size_t i = 0, j = 0, k = 0;
+            while (i < a.array.size() && j < b.array.size()) {
+                uint16_t x = a.array[i];
+                uint16_t y = b.array[j];
+                result.array[k] = x;
+                k += x == y;
+                i += x <= y;
+                j += y <= x;
+            }
+            result.array.resize(k);
+            result.cardinality = static_cast<uint32_t>(k);
+        }
+        return result;
+    }
+
+    static Container unite(const Container& a, const Container& b) {
+        Container result;
+        result.key = a.key;
+        if (a.is_bitmap() && b.is_bitmap()) {
+            result.bits.resize(BITMAP_WORDS);
+            for (uint32_t w = 0; w < BITMAP_WORDS; w++) {
+                result.bits[w] = a.bits[w] | b.bits[w];
+            }
+            result.count_bits();
+        }
+        else if (a.is_bitmap() || b.is_bitmap()) {
+            const Container& array = a.is_bitmap() ? b : a;
+            result.bits = a.is_bitmap() ? a.bits : b.bits;
+            for (auto& value : array.array) {
+                result.bits[value >> 6] |= uint64_t(1) << (value & 63);
+            }
+            result.count_bits();
+        }
+        else {
+            std::set_union(a.array.begin(), a.array.end(), b.array.begin(), b.array.end(),
+                std::back_inserter(result.array));
+            result.cardinality = static_cast<uint32_t>(result.array.size());
+            result.normalize();
+        }
+        return result;
+    }
+
+    static Container subtract(const Container& a, const Container& b) {
+        Container result;
+        result.key = a.key;
+        if (a.is_bitmap()) {
+            result.bits = a.bits;
+            if (b.is_bitmap()) {
+                for (uint32_t w = 0; w < BITMAP_WORDS; w++) {
+                    result.bits[w] &= ~b.bits[w];
+                }
+            }
+            else {
+                for (auto& value : b.array) {
+                    result.bits[value >> 6] &= ~(uint64_t(1) << (value & 63));
+                }
+            }
+            result.count_bits();
+            result.normalize();
+        }
+        else if (b.is_bitmap()) {
+            for (auto& value : a.array) {
+                if (!b.contains(value)) {
+                    result.array.push_back(value);
+                }
+            }
+            result.cardinality = static_cast<uint32_t>(result.array.size());
+        }
+        else {
+            std::set_difference(a.array.begin(), a.array.end(), b.array.begin(), b.array.end(),
+                std::back_inserter(result.array));
+            result.cardinality = static_cast<uint32_t>(result.array.size());
+        }
+        return result;
+    }
+
+public:
+    /**
+     * Builds a bitmap from IDs in ascending order, without repetitions.
+     *
+     * @param first The beginning of the sorted IDs.
+     * @param last The end of the sorted IDs.
+     * @return The bitmap containing the IDs.
+     */
+    static RoaringBitmap from_sorted(const uint32_t* first, const uint32_t* last) {
+        RoaringBitmap bitmap;
+        while (first != last) {
+            uint16_t key = high(*first);
+            const uint32_t* end = first;
+            while (end != last && high(*end) == key) {
+                end++;
+            }
+            Container container;
+            container.key = key;
+            container.cardinality = static_cast<uint32_t>(end - first);
+            container.array.reserve(container.cardinality);
+            for (; first != end; first++) {
+                container.array.push_back(low(*first));
+            }
+            container.normalize();
+            bitmap.containers.push_back(std::move(container));
+        }
+        return bitmap;
+    }
+
+    /**
+     * Adds an ID to the bitmap.
+     *
+     * @param id The ID to be added.
+     */
+    void add(uint32_t id) {
+        auto it = std::lower_bound(containers.begin(), containers.end(), high(id),
+            [](const Container& container, uint16_t key) { return container.key < key; });
+        if (it == containers.end() || it->key != high(id)) {
+            it = containers.insert(it, Container());
+            it->key = high(id);
+        }
+        uint16_t value = low(id);
+        if (it->is_bitmap()) {
+            uint64_t& word = it->bits[value >> 6];
+            if (!((word >> (value & 63)) & 1)) {
+                word |= uint64_t(1) << (value & 63);
+                it->cardinality++;
+            }
+            return;
+        }
+        auto position = std::lower_bound(it->array.begin(), it->array.end(), value);
+        if (position == it->array.end() || *position != value) {
+            it->array.insert(position, value);
+            it->cardinality++;
+            it->normalize();
+        }
+    }
+
+    /**
+     * Checks whether an ID is in the bitmap.
+     *
+     * @param id The ID to search for.
+     * @return True if the ID is present, false otherwise.
+     */
+    bool contains(uint32_t id) const {
+        auto it = std::lower_bound(containers.begin(), containers.end(), high(id),
+            [](const Container& container, uint16_t key) { return container.key < key; });
+        return it != containers.end() && it->key == high(id) && it->contains(low(id));
+    }
+
+    /**
+     * Computes the intersection of two bitmaps.
+     *
+     * @param a The first bitmap.
+     * @param b The second bitmap.
+     * @return The IDs present in both bitmaps.
+     */
+    static RoaringBitmap intersect(const RoaringBitmap& a, const RoaringBitmap& b) {
+        RoaringBitmap result;
+        size_t i = 0, j = 0;
+        while (i < a.containers.size() && j < b.containers.size()) {
+            if (a.containers[i].key < b.containers[j].key) {
+                i++;
+            }
+            else if (b.containers[j].key < a.containers[i].key) {
+                j++;
+            }
+            else {
+                Container container = intersect(a.containers[i++], b.containers[j++]);
+                if (container.cardinality > 0) {
+                    result.containers.push_back(std::move(container));
+                }
+            }
+        }
+        return result;
+    }
+
+    /**
+     * Computes the union of two bitmaps.
+     *
+     * @param a The first bitmap.
+     * @param b The second bitmap.
+     * @return The IDs present in any of the bitmaps.
+     */
+    static RoaringBitmap unite(const RoaringBitmap& a, const RoaringBitmap& b) {
+        RoaringBitmap result;
+        size_t i = 0, j = 0;
+        while (i < a.containers.size() || j < b.containers.size()) {
+            if (j == b.containers.size() || (i < a.containers.size() && a.containers[i].key < b.containers[j].key)) {
+                result.containers.push_back(a.containers[i++]);
+            }
+            else if (i == a.containers.size() || b.containers[j].key < a.containers[i].key) {
+                result.containers.push_back(b.containers[j++]);
+            }
+            else {
+                result.containers.push_back(unite(a.containers[i++], b.containers[j++]));
+            }
+        }
+        return result;
+    }
+
+    /**
+     * Computes the difference of two bitmaps.
+     *
+     * @param a The bitmap to subtract from.
+     * @param b The bitmap to subtract.
+     * @return The IDs present in the first bitmap but not in the second.
+     */
+    static RoaringBitmap subtract(const RoaringBitmap& a, const RoaringBitmap& b) {
+        RoaringBitmap result;
+        size_t j = 0;
+        for (auto& container : a.containers) {
+            while (j < b.containers.size() && b.containers[j].key < container.key) {
+                j++;
+            }
+            if (j == b.containers.size() || b.containers[j].key != container.key) {
+                result.containers.push_back(container);
+                continue;
+            }
+            Container difference = subtract(container, b.containers[j]);
+            if (difference.cardinality > 0) {
+                result.containers.push_back(std::move(difference));
+            }
+        }
+        return result;
+    }
+
+    /**
+     * Calls a function for every ID greater than a given one, in ascending order.
+     *
+     * @param after Only IDs greater than this one are visited (negative to visit all).
+     * @param function The function to call, as function(id); returning false stops the visit.
+     */
+    template <class Function>
+    void for_each(int64_t after, Function function) const {
+        if (after >= UINT32_MAX) {
+            return;
+        }
+        uint32_t first = after < 0 ? 0 : static_cast<uint32_t>(after) + 1;
+        for (auto& container : containers) {
+            if (container.key < high(first)) {
+                continue;
+            }
+            uint32_t base = uint32_t(container.key) << 16;
+            uint16_t start = container.key == high(first) ? low(first) : 0;
+            if (container.is_bitmap()) {
+                for (uint32_t w = start >> 6; w < BITMAP_WORDS; w++) {
+                    uint64_t word = container.bits[w];
+                    if (w == uint32_t(start >> 6)) {
+                        word &= ~uint64_t(0) << (start & 63);
+                    }
+                    for (; word; word &= word - 1) {
+                        if (!function(base + w * 64 + __builtin_ctzll(word))) {
+                            return;
+                        }
+                    }
+                }
+            }
+            else {
+                for (auto it = std::lower_bound(container.array.begin(), container.array.end(), start);
+                    it != container.array.end(); it++) {
+                    if (!function(base + *it)) {
+                        return;
+                    }
+                }
+            }
+        }
+    }
+
+    /**
+     * Returns the number of IDs in the bitmap.
+     */
+    size_t cardinality() const {
+        size_t total = 0;
+        for (auto& container : containers) {
+            total += container.cardinality;
+        }
+        return total;
+    }
+
+    /**
+     * Returns the number of bytes used by the bitmap.
+     */
+    size_t bytes() const {
+        size_t total = containers.capacity() * sizeof(Container);
+        for (auto& container : containers) {
+            total += container.array.capacity() * sizeof(uint16_t) + container.bits.capacity() * sizeof(uint64_t);
+        }
+        return total;
+    }
+};
+
+#endif // ROARING_H
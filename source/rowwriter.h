@@ -0,0 +1,146 @@
+#ifndef ROW_WRITER_H
+#define ROW_WRITER_H
+
+#include <cstdint>
+#include <cstdio>
+#include <ostream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#define ROW_BUFFER_SIZE (1 << 16)  // Bytes of rows gathered before writing them to the stream
+
+/**
+ * Buffered writer of fixed-width table rows. Cells are formatted straight into a byte
+ * buffer that is reused across rows and left-aligned with spaces, as std::left with
+ * std::setw would (longer values are not cut); the buffer reaches the stream in large
+ * writes. Numbers are printed as an ostream with the default flags prints them.
+ */
+class RowWriter {
+private:
+    std::ostream* out;  // nullptr keeps every row in the buffer
+    std::string buffer;
+    size_t flush_size;
+
+    /**
+     * Pads the cell just written up to its width.
+     *
+     * @param length The length of the cell.
+     * @param width The width of the column.
+     */
+    void pad(size_t length, size_t width) {
+        if (length < width) {
+            buffer.append(width - length, ' ');
+        }
+    }
+
+public:
+    /**
+     * Creates a writer of rows to a stream.
+     *
+     * @param out The stream receiving the rows.
+     * @param flush_size The number of bytes gathered before writing them.
+     */
+    RowWriter(std::ostream& out, size_t flush_size = ROW_BUFFER_SIZE) : out(&out), flush_size(flush_size) {
+        buffer.reserve(flush_size + 256);
+    }
+
+    /**
+     * Creates a writer that keeps its rows in memory, to be read with str.
+     */
+    RowWriter() : out(nullptr), flush_size(SIZE_MAX) {}
+
+    ~RowWriter() {
+        flush();
+    }
+
+    RowWriter& cell(const std::string& text, size_t width) {
+        buffer.append(text);
+        pad(text.size(), width);
+        return *this;
+    }
+
+    RowWriter& cell(const char* text, size_t width) {
+        size_t start = buffer.size();
+        buffer.append(text);
+        pad(buffer.size() - start, width);
+        return *this;
+    }
+
+    template <typename T>
+    typename std::enable_if<std::is_integral<T>::value, RowWriter&>::type cell(T value, size_t width) {
+        char digits[24];
+        char* end = digits + sizeof(digits);
+        char* first = end;
+        bool negative = value < 0;
+        uint64_t magnitude = negative ? 0 - static_cast<uint64_t>(value) : static_cast<uint64_t>(value);
+        do {
+            *--first = static_cast<char>('0' + magnitude % 10);
+            magnitude /= 10;
+        } while (magnitude);
+        if (negative) {
+            *--first = '-';
+        }
+        buffer.append(first, end);
+        pad(end - first, width);
+        return *this;
+    }
+
+    RowWriter& cell(double value, size_t width) {
+        // An ostream prints floating point numbers with %g and a precision of 6
+        char text[32];
+        int length = std::snprintf(text, sizeof(text), "%g", value);
+        buffer.append(text, length);
+        pad(length, width);
+        return *this;
+    }
+
+    /**
+     * Writes a header row.
+     *
+     * @param headers The name of every column.
+     * @param widths The width of every column.
+     */
+    void header(const std::vector<std::string>& headers, const std::vector<size_t>& widths) {
+        for (size_t i = 0; i < headers.size(); i++) {
+            cell(headers[i], widths[i]);
+        }
+        end_row();
+    }
+
+    /**
+     * Ends the current row, writing the buffer once it is large enough.
+     */
+    void end_row() {
+        buffer.push_back('\n');
+        if (buffer.size() >= flush_size) {
+            flush();
+        }
+    }
+
+    /**
+     * Writes the gathered rows to the stream. Needed before writing to the stream directly.
+     */
+    void flush() {
+        if (out && !buffer.empty()) {
+            out->write(buffer.data(), buffer.size());
+            buffer.clear();
+        }
+    }
+
+    /**
+     * Returns the rows kept in memory.
+     */
+    const std::string& str() const {
+        return buffer;
+    }
+
+    /**
+     * Drops the rows kept in memory, keeping the buffer for the next ones.
+     */
+    void clear() {
+        buffer.clear();
+    }
+};
+
+#endif // ROW_WRITER_H
@@ -0,0 +1,182 @@
+#ifndef SIMILARITY_INDEX_H
+#define SIMILARITY_INDEX_H
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include "parallel.h"
+#include "playerhashmap.h"
+
+struct Neighbour {
+    uint32_t player_id;
+    float similarity;
+
+    bool operator<(const Neighbour& other) const {
+        return similarity > other.similarity
+            || (similarity == other.similarity && player_id < other.player_id);
+    }
+};
+
+class PlayerSimilarityIndex {
+private:
+    struct Entry {
+        uint32_t index;  // Player row (user-major) or user row (player-major)
+        float value;
+    };
+
+    size_t neighbours_per_player = 0;
+    std::vector<uint32_t> player_ids;
+    std::vector<uint32_t> neighbour_counts;
+    std::vector<Neighbour> neighbours;
+
+public:
+    bool built = false;
+    uint64_t co_ratings = 0;
+
+    /**
+     * Precomputes the K most similar players of every player, comparing the
+     * columns of the user x player ratings matrix.
+     *
+     * @param players The PlayerHashMap containing player information.
+     * @param ratings The ratings given by each user (a RatingHashMap).
+     * @param k The number of neighbours to keep per player.
+     * @param adjusted Whether to subtract each user's mean score (adjusted cosine).
+     * @param threads The number of threads to use (0 uses the hardware concurrency).
+     */
+    template <class RatingSource>
+    void build(PlayerHashMap& players, RatingSource& ratings, size_t k, bool adjusted, unsigned threads) {
+        const uint32_t n = players.player_count;
+        neighbours_per_player = k;
+        player_ids.assign(n, 0);
+        for (uint32_t i = 0; i < players.table_size; i++) {
+            for (auto& player : players.table[i]) {
+                player_ids[player.index] = player.id;
+            }
+        }
+
+        // User-major sparse matrix, with user means removed when adjusting
+        std::vector<size_t> user_offsets = { 0 };
+        std::vector<Entry> user_entries;
+        std::vector<size_t> player_offsets(n + 1, 0);
+        ratings.for_each_user([&](const Rating* begin, const Rating* end) {
+            double mean = 0;
+            if (adjusted) {
+                for (const Rating* rating = begin; rating != end; rating++) {
+                    mean += rating->score;
+                }
+                mean /= (end - begin);
+            }
+            for (const Rating* rating = begin; rating != end; rating++) {
+                Player* player = players.search(rating->player_id);
+                if (!player) {
+                    continue;
+                }
+                user_entries.push_back({ player->index, static_cast<float>(rating->score - mean) });
+                player_offsets[player->index + 1]++;
+            }
+            user_offsets.push_back(user_entries.size());
+        });
+
+        // Player-major transpose of the same matrix, built with a counting pass
+        for (uint32_t p = 0; p < n; p++) {
+            player_offsets[p + 1] += player_offsets[p];
+        }
+        std::vector<Entry> player_entries(user_entries.size());
+        std::vector<size_t> fill(player_offsets.begin(), player_offsets.end() - 1);
+        for (uint32_t u = 0; u + 1 < user_offsets.size(); u++) {
+            for (size_t e = user_offsets[u]; e < user_offsets[u + 1]; e++) {
+                player_entries[fill[user_entries[e].index]++] = { u, user_entries[e].value };
+            }
+        }
+
+        std::vector<float> norms(n, 0);
+        for (uint32_t p = 0; p < n; p++) {
+            double sum = 0;
+            for (size_t e = player_offsets[p]; e < player_offsets[p + 1]; e++) {
+                sum += double(player_entries[e].value) * player_entries[e].value;
+            }
+            norms[p] = static_cast<float>(std::sqrt(sum));
+        }
+
+        // Sparse dot products: every user who rated p contributes to all players they rated
+        if (threads == 0) {
+            threads = default_thread_count();
+        }
+        neighbour_counts.assign(n, 0);
+        neighbours.assign(size_t(n) * k, Neighbour{ 0, 0 });
+        std::vector<std::vector<float>> accumulators(threads, std::vector<float>(n, 0));
+        std::vector<std::vector<uint32_t>> marks(threads, std::vector<uint32_t>(n, 0));
+        std::vector<std::vector<uint32_t>> touched(threads);
+        std::vector<std::vector<Neighbour>> candidates(threads);
+        std::vector<uint64_t> pair_counts(threads, 0);
+
+        parallel_for(n, [&](size_t p, unsigned t) {
+            std::vector<float>& accumulator = accumulators[t];
+            std::vector<uint32_t>& mark = marks[t];
+            std::vector<uint32_t>& seen = touched[t];
+            std::vector<Neighbour>& best = candidates[t];
+            if (norms[p] == 0) {
+                return;
+            }
+            uint64_t pairs = 0;
+            for (size_t e = player_offsets[p]; e < player_offsets[p + 1]; e++) {
+                const Entry& column = player_entries[e];
+                for (size_t f = user_offsets[column.index]; f < user_offsets[column.index + 1]; f++) {
+                    const Entry& row = user_entries[f];
+                    if (row.index == p) {
+                        continue;
+                    }
+                    if (mark[row.index] != p + 1) {
+                        mark[row.index] = static_cast<uint32_t>(p + 1);
+                        seen.push_back(row.index);
+                    }
+                    accumulator[row.index] += column.value * row.value;
+                    pairs++;
+                }
+            }
+
+            best.clear();
+            for (auto& q : seen) {
+                if (norms[q] != 0) {
+                    best.push_back({ player_ids[q], accumulator[q] / (norms[p] * norms[q]) });
+                }
+                accumulator[q] = 0;
+            }
+            seen.clear();
+            pair_counts[t] += pairs;
+
+            size_t kept = std::min(k, best.size());
+            std::partial_sort(best.begin(), best.begin() + kept, best.end());
+            std::copy(best.begin(), best.begin() + kept, neighbours.begin() + p * k);
+            neighbour_counts[p] = static_cast<uint32_t>(kept);
+        }, threads, 64);
+
+        co_ratings = 0;
+        for (auto& count : pair_counts) {
+            co_ratings += count;
+        }
+        built = true;
+    }
+
+    /**
+     * Retrieves the most similar players of a given player.
+     *
+     * @param player The player whose neighbours are to be retrieved.
+     * @param k The maximum number of neighbours to retrieve.
+     * @return A vector containing up to K neighbours, most similar first.
+     */
+    std::vector<Neighbour> similar(const Player& player, size_t k) {
+        size_t start = size_t(player.index) * neighbours_per_player;
+        size_t count = std::min<size_t>(k, neighbour_counts[player.index]);
+        return std::vector<Neighbour>(neighbours.begin() + start, neighbours.begin() + start + count);
+    }
+
+    /**
+     * Returns the maximum number of neighbours stored per player.
+     */
+    size_t max_neighbours() const {
+        return neighbours_per_player;
+    }
+};
+
+#endif // SIMILARITY_INDEX_H
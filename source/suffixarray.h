@@ -0,0 +1,155 @@
+#ifndef SUFFIX_ARRAY_H
+#define SUFFIX_ARRAY_H
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "csv.h"
+#include "cursor.h"
+
+/**
+ * Suffix array over the player names, for substring (infix) searches. The names are
+ * folded to upper case and concatenated, each one ended by a '\0', and every suffix
+ * starting inside a name is sorted; the suffixes beginning with a pattern then form
+ * one contiguous range, found with two binary searches in O(pattern length * log n).
+ */
+class NameSuffixArray {
+private:
+    std::string text;                // Folded names, each one ended by a '\0'
+    std::vector<uint32_t> starts;    // Offset of every name in the text
+    std::vector<uint32_t> player_ids;
+    std::vector<uint32_t> suffixes;  // Offsets of the suffixes, in lexicographic order
+    std::vector<uint32_t> suffix_names;  // Index of the name of every suffix, so matches need no search
+
+public:
+    /**
+     * Adds a player's name. The suffixes are sorted by build.
+     *
+     * @param player_name The name of the player.
+     * @param player_id The sofifa_id associated with the player.
+     */
+    void insert(const std::string& player_name, uint32_t player_id) {
+        starts.push_back(static_cast<uint32_t>(text.size()));
+        player_ids.push_back(player_id);
+        for (auto& c : player_name) {
+            // A '\0' would end the suffix early
+            text.push_back(c ? static_cast<char>(toupper(static_cast<unsigned char>(c))) : ' ');
+        }
+        text.push_back('\0');
+    }
+
+    /**
+     * Sorts the suffixes of every inserted name.
+     */
+    void build() {
+        suffixes.clear();
+        suffixes.reserve(text.size() - starts.size());
+        for (size_t i = 0; i < text.size(); i++) {
+            if (text[i] != '\0') {
+                suffixes.push_back(static_cast<uint32_t>(i));
+            }
+        }
+        const char* base = text.c_str();
+        std::sort(suffixes.begin(), suffixes.end(), [base](uint32_t a, uint32_t b) {
+            return std::strcmp(base + a, base + b) < 0;
+        });
+        suffix_names.resize(suffixes.size());
+        for (size_t i = 0; i < suffixes.size(); i++) {
+            suffix_names[i] = static_cast<uint32_t>(
+                std::upper_bound(starts.begin(), starts.end(), suffixes[i]) - starts.begin() - 1);
+        }
+    }
+
+    /**
+     * Searches for players whose names contain a given text, ignoring letter case.
+     * The players are returned in the order of their matching suffixes, and the cursor
+     * holds the position of the last one in the suffix array, so each page resumes
+     * there and costs O(page size) instead of visiting every match again.
+     *
+     * @param pattern The text to search for.
+     * @param limit The maximum number of sofifa_id's to return.
+     * @param cursor A reference to the continuation cursor: when not empty, the search
+     *        resumes after the page that produced it. On return it holds the cursor of
+     *        the next page, or is empty if there are no more players.
+     * @return A vector containing up to limit sofifa_id's.
+     */
+    std::vector<uint32_t> search(const std::string& pattern, size_t limit, PageCursor& cursor) const {
+        std::vector<uint32_t> id_vector;
+        std::string key;
+        for (auto& c : pattern) {
+            key.push_back(static_cast<char>(toupper(static_cast<unsigned char>(c))));
+        }
+        const char* base = text.c_str();
+        size_t length = key.size();
+        auto first = std::lower_bound(suffixes.begin(), suffixes.end(), key, [&](uint32_t suffix, const std::string& k) {
+            return std::strncmp(base + suffix, k.c_str(), length) < 0;
+        });
+        auto last = std::upper_bound(first, suffixes.end(), key, [&](const std::string& k, uint32_t suffix) {
+            return std::strncmp(base + suffix, k.c_str(), length) > 0;
+        });
+
+        size_t begin = first - suffixes.begin();
+        size_t end = last - suffixes.begin();
+        if (!cursor.empty()) {
+            begin = std::max<size_t>(begin, static_cast<size_t>(cursor[0]) + 1);
+        }
+        cursor.clear();
+        size_t previous = begin;
+        for (size_t i = begin; i < end; i++) {
+            uint32_t name = suffix_names[i];
+            // A name containing the pattern several times has several suffixes in the
+            // range, so it is only returned for its leftmost occurrence
+            if (text.find(key, starts[name]) != suffixes[i]) {
+                continue;
+            }
+            if (id_vector.size() == limit) {
+                // At least one more player: the next page starts after the last one
+                if (limit > 0) {
+                    cursor.push_back(static_cast<uint32_t>(previous));
+                }
+                break;
+            }
+            id_vector.push_back(player_ids[name]);
+            previous = i;
+        }
+        return id_vector;
+    }
+
+    /**
+     * Returns the number of suffixes in the array.
+     */
+    size_t size() const {
+        return suffixes.size();
+    }
+
+    /**
+     * Returns the number of bytes used by the suffix array, including the names.
+     */
+    size_t bytes() const {
+        return text.capacity() + (starts.capacity() + player_ids.capacity()
+            + suffixes.capacity() + suffix_names.capacity()) * sizeof(uint32_t);
+    }
+
+    /**
+     * Builds the NameSuffixArray by reading and parsing data from a CSV file.
+     *
+     * @param csv_filename The path to the CSV file containing the FIFA players data.
+     */
+    void from_csv(std::string csv_filename) {
+        io::CSVReader<2, io::trim_chars<' '>, io::double_quote_escape<',', '\"'> > in(csv_filename);
+        std::string player_name;
+        uint32_t player_id;
+
+        in.read_header(io::ignore_extra_column, "sofifa_id", "name");
+
+        while (in.read_row(player_id, player_name)) {
+            insert(player_name, player_id);
+        }
+        build();
+    }
+};
+
+#endif // SUFFIX_ARRAY_H
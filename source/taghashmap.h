@@ -4,14 +4,42 @@
 #include <iostream>
 #include <vector>
 #include <string>
+#include <algorithm>
+#include <cstdint>
 #include "csv.h"
 #include "hashmap.h"
+#include "parallel.h"
+#include "roaring.h"
 
 #define PRIME 31
 
 struct TagVector {
     std::string name;
     std::vector<uint32_t> vector;
+    RoaringBitmap bitmap;  // Replaces the vector when the map uses bitmaps
+
+    /**
+     * Returns the number of players with the tag.
+     */
+    size_t count() const {
+        return vector.empty() ? bitmap.cardinality() : vector.size();
+    }
+
+    /**
+     * Calls a function for every player ID with the tag, in ascending order.
+     *
+     * @param function The function to call, as function(id).
+     */
+    template <class Function>
+    void for_each(Function function) const {
+        for (auto& id : vector) {
+            function(id);
+        }
+        bitmap.for_each(-1, [&](uint32_t id) {
+            function(id);
+            return true;
+        });
+    }
 };
 
 class TagHashMap : public HashMap<TagVector, std::string> {
@@ -22,9 +50,9 @@ private:
      * @param key The key for which to calculate the hash value (string : tag).
      * @return The calculated hash value (16-bit uint).
      */
-    uint32_t hash(std::string key) {
+    uint32_t hash(const std::string& key) {
         uint32_t hash_key = 0;
-        for (char& c : key) {
+        for (const char& c : key) {
             uint32_t i = static_cast<uint32_t>(c);
             hash_key = (PRIME * hash_key + i) % table_size;
         }
@@ -38,20 +66,23 @@ private:
      * @param key The key (tag name) to compare against.
      * @return True if the name of the TagVector object is equal to the key, false otherwise.
      */
-    bool equal(TagVector tag, std::string key) {
+    bool equal(const TagVector& tag, const std::string& key) {
         return tag.name == key;
     }
 
 public:
+    bool bitmaps = false;  // Whether posting lists are kept as compressed bitmaps
+
     using HashMap<TagVector, std::string>::HashMap;
 
     /**
-     * Inserts a player ID into the vector of a certaing tag.
+     * Appends a player ID to the vector of a certain tag, without keeping the vector
+     * ordered. Used for bulk loading, followed by a call to sort_tags.
      *
-     * @param player_id The player ID to be inserted into the vector.
-     * @param tag The tag into which the player ID will be inserted.
-    */
-    void insert_player_to_tag(uint32_t player_id, std::string tag) {
+     * @param player_id The player ID to be appended to the vector.
+     * @param tag The tag into which the player ID will be appended.
+     */
+    void append_player_to_tag(uint32_t player_id, const std::string& tag) {
         TagVector* item_ptr = search(tag);
         if (!item_ptr) {
             // Tag vector was still not initialized
@@ -61,82 +92,75 @@ public:
             insert(tag, item);
             return;
         }
-        int i = 0;
-        for (auto& stored_id : item_ptr->vector) {
-            if (stored_id == player_id) {
-                // Player ID already inside tag vector
-                return;
-            }
-            else if (stored_id > player_id) {
-                // Correct position for player ID found
-                break;
-            }
-            i++;
-        }
-        item_ptr->vector.insert(item_ptr->vector.begin() + i, player_id);
+        item_ptr->vector.push_back(player_id);
     }
 
     /**
-     * Searches for the intersection of player IDs based on provided tags.
+     * Sorts the vector of every tag in ascending order and removes duplicated IDs,
+     * handling different tags in parallel. When the map uses bitmaps, the vectors are
+     * then compressed into bitmaps and released.
      *
-     * @note It is expected that the tag vectors are in ascending order.
-     * @param tags A vector of strings representing the tags to search for.
-     * @return A vector of uint32_t containing the common player IDs.
+     * @param threads The number of threads to use (0 uses the hardware concurrency).
      */
-    std::vector<uint32_t> search_tags(std::vector<std::string> tags) {
-        std::vector<uint32_t> intersection;
-        std::vector<std::vector<uint32_t>> vectors;
-        std::vector<uint16_t> indexes(tags.size(), 0);
-
-        // Find all tag vectors
-        size_t i = 0;
-        for (auto& tag_name : tags) {
-            TagVector* tag = search(tag_name);
-            if (!tag) {
-                // If a tag is not found, return an empty vector
-                return std::vector<uint32_t>();
+    void sort_tags(unsigned threads = 0) {
+        std::vector<TagVector*> tag_vectors;
+        for (uint32_t i = 0; i < table_size; i++) {
+            for (auto& tag : table[i]) {
+                tag_vectors.push_back(&tag);
             }
-            vectors.push_back(tag->vector);
-            i++;
         }
-
-        // Find intersection of the tag vectors
-        for (auto& player : vectors[0]) {
-            bool present_in_all = true;
-            for (i = 1; i < indexes.size(); i++) {
-                while (vectors[i][indexes[i]] < player) {
-                    indexes[i]++;
-                    if (indexes[i] >= vectors[i].size()) {
-                        return intersection;
-                    }
-                }
-                if (vectors[i][indexes[i]] != player) {
-                    present_in_all = false;
-                }
+        // Largest tags first, so a single big tag does not finish last
+        std::sort(tag_vectors.begin(), tag_vectors.end(), [](TagVector* a, TagVector* b) {
+            return a->vector.size() > b->vector.size();
+        });
+        parallel_for(tag_vectors.size(), [&](size_t t, unsigned) {
+            std::vector<uint32_t>& vector = tag_vectors[t]->vector;
+            std::sort(vector.begin(), vector.end());
+            vector.erase(std::unique(vector.begin(), vector.end()), vector.end());
+            if (bitmaps) {
+                RoaringBitmap bitmap = RoaringBitmap::from_sorted(vector.data(), vector.data() + vector.size());
+                tag_vectors[t]->bitmap = RoaringBitmap::unite(tag_vectors[t]->bitmap, bitmap);
+                std::vector<uint32_t>().swap(vector);
             }
-            if (present_in_all) {
-                intersection.push_back(player);
+            else {
+                vector.shrink_to_fit();
             }
-        }
+        }, threads);
+    }
 
-        return intersection;
+    /**
+     * Returns the number of bytes used by the posting lists of all tags.
+     */
+    size_t posting_bytes() {
+        size_t total = 0;
+        for (uint32_t i = 0; i < table_size; i++) {
+            for (auto& tag : table[i]) {
+                total += tag.vector.capacity() * sizeof(uint32_t) + tag.bitmap.bytes();
+            }
+        }
+        return total;
     }
 
     /**
      * Populates the TagHashMap by reading and parsing data from a CSV file.
      *
      * @param csv_filename The path to the CSV file containing the players tag data.
+     * @param threads The number of threads used for sorting (0 uses the hardware concurrency).
      */
-    void from_csv(std::string csv_filename) {
+    void from_csv(std::string csv_filename, unsigned threads = 0) {
         io::CSVReader<2> in(csv_filename);
         uint32_t player_id;
+        char* tag_column;
         std::string tag;
 
         in.read_header(io::ignore_extra_column, "sofifa_id", "tag");
 
-        while (in.read_row(player_id, tag)) {
-            insert_player_to_tag(player_id, tag);
+        while (in.read_row(player_id, tag_column)) {
+            // Reuse the same string, so rows do not allocate
+            tag.assign(tag_column);
+            append_player_to_tag(player_id, tag);
         }
+        sort_tags(threads);
     }
 };
 
@@ -0,0 +1,584 @@
+#ifndef TAG_QUERY_H
+#define TAG_QUERY_H
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <deque>
+#include <queue>
+#include <string>
+#include <vector>
+#include "cursor.h"
+#include "intersection.h"
+#include "taghashmap.h"
+
+struct TagQueryNode {
+    enum Type { TAG, AND, OR, NOT } type;
+    std::string name;                   // Tag name (TAG only)
+    const PostingList* list = nullptr;  // Posting list of the tag (TAG only)
+    const RoaringBitmap* bitmap = nullptr;  // Bitmap of the tag, when the map uses bitmaps
+    std::vector<TagQueryNode> children;
+    size_t cost = 0;                    // Upper bound of the number of matching players
+
+    TagQueryNode(Type type = TAG) : type(type) {}
+};
+
+/**
+ * Boolean query over the tag posting lists, such as
+ * ('Speedster' OR 'Dribbler') AND NOT 'Injury Prone'.
+ * Tags are quoted, operators are AND, OR and NOT (in any case), parentheses group
+ * terms, and tags written next to each other are joined with AND. NOT only excludes
+ * players from an AND that has at least one other term.
+ *
+ * Evaluation is cost based: the terms of an AND are intersected smallest first, with
+ * the excluded terms applied last to each candidate, and the terms of an OR are
+ * merged k ways. Tag posting lists are read in place. When the tags are kept as
+ * bitmaps, the same order is used with word-parallel AND, OR and ANDNOT.
+ */
+class TagQuery {
+private:
+    struct Token {
+        enum Type { TAG, AND, OR, NOT, OPEN, CLOSE, END } type;
+        std::string text;
+    };
+
+    std::vector<Token> tokens;
+    size_t next_token = 0;
+    TagQueryNode root;
+    std::string error;
+    bool bitmaps = false;
+
+    /**
+     * Splits a query into tokens. Unquoted key=value words are command options and
+     * are skipped.
+     *
+     * @param text The query text.
+     * @return True if the text is valid, false otherwise.
+     */
+    bool tokenize(const std::string& text) {
+        tokens.clear();
+        size_t i = 0;
+        while (i < text.size()) {
+            char c = text[i];
+            if (std::isspace(static_cast<unsigned char>(c))) {
+                i++;
+            }
+            else if (c == '\'') {
+                size_t end = text.find('\'', i + 1);
+                if (end == std::string::npos) {
+                    error = "Missing closing quote.";
+                    return false;
+                }
+                tokens.push_back({ Token::TAG, text.substr(i + 1, end - i - 1) });
+                i = end + 1;
+            }
+            else if (c == '(' || c == ')') {
+                tokens.push_back({ c == '(' ? Token::OPEN : Token::CLOSE, std::string(1, c) });
+                i++;
+            }
+            else {
+                size_t end = i;
+                while (end < text.size() && !std::isspace(static_cast<unsigned char>(text[end]))
+                    && text[end] != '(' && text[end] != ')' && text[end] != '\'') {
+                    end++;
+                }
+                std::string word = text.substr(i, end - i);
+                std::string upper = word;
+                for (auto& letter : upper) {
+                    letter = static_cast<char>(std::toupper(static_cast<unsigned char>(letter)));
+                }
+                if (upper == "AND") {
+                    tokens.push_back({ Token::AND, word });
+                }
+                else if (upper == "OR") {
+                    tokens.push_back({ Token::OR, word });
+                }
+                else if (upper == "NOT") {
+                    tokens.push_back({ Token::NOT, word });
+                }
+                else if (word.find('=') == std::string::npos) {
+                    error = "Unexpected \"" + word + "\" (tags must be quoted).";
+                    return false;
+                }
+                i = end;
+            }
+        }
+        tokens.push_back({ Token::END, "" });
+        return true;
+    }
+
+    const Token& peek() const {
+        return tokens[next_token];
+    }
+
+    // or_expression := and_expression (OR and_expression)*
+    bool parse_or(TagQueryNode& node) {
+        if (!parse_and(node)) {
+            return false;
+        }
+        while (peek().type == Token::OR) {
+            next_token++;
+            TagQueryNode right;
+            if (!parse_and(right)) {
+                return false;
+            }
+            join(TagQueryNode::OR, node, right);
+        }
+        return true;
+    }
+
+    // and_expression := unary ([AND] unary)*
+    bool parse_and(TagQueryNode& node) {
+        if (!parse_unary(node)) {
+            return false;
+        }
+        while (true) {
+            Token::Type type = peek().type;
+            if (type == Token::AND) {
+                next_token++;
+            }
+            else if (type != Token::TAG && type != Token::NOT && type != Token::OPEN) {
+                return true;
+            }
+            TagQueryNode right;
+            if (!parse_unary(right)) {
+                return false;
+            }
+            join(TagQueryNode::AND, node, right);
+        }
+    }
+
+    // unary := NOT unary | '(' or_expression ')' | tag
+    bool parse_unary(TagQueryNode& node) {
+        const Token& token = peek();
+        if (token.type == Token::NOT) {
+            next_token++;
+            TagQueryNode child;
+            if (!parse_unary(child)) {
+                return false;
+            }
+            if (child.type == TagQueryNode::NOT) {
+                // Double negation
+                TagQueryNode inner = child.children[0];
+                node = inner;
+                return true;
+            }
+            node = TagQueryNode{ TagQueryNode::NOT };
+            node.children.push_back(child);
+            return true;
+        }
+        if (token.type == Token::OPEN) {
+            next_token++;
+            if (!parse_or(node)) {
+                return false;
+            }
+            if (peek().type != Token::CLOSE) {
+                error = "Missing closing parenthesis.";
+                return false;
+            }
+            next_token++;
+            return true;
+        }
+        if (token.type == Token::TAG) {
+            node = TagQueryNode{ TagQueryNode::TAG };
+            node.name = token.text;
+            next_token++;
+            return true;
+        }
+        error = token.type == Token::END ? "Incomplete query." : "Unexpected \"" + token.text + "\".";
+        return false;
+    }
+
+    /**
+     * Combines two nodes with an operator, flattening nested nodes of the same operator.
+     *
+     * @param type The operator (AND or OR).
+     * @param node A reference to the left node, which receives the combined node.
+     * @param right The right node.
+     */
+    static void join(TagQueryNode::Type type, TagQueryNode& node, TagQueryNode& right) {
+        if (node.type != type) {
+            TagQueryNode combined{ type };
+            combined.children.push_back(std::move(node));
+            node = std::move(combined);
+        }
+        if (right.type == type) {
+            for (auto& child : right.children) {
+                node.children.push_back(std::move(child));
+            }
+        }
+        else {
+            node.children.push_back(std::move(right));
+        }
+    }
+
+    /**
+     * Resolves the posting lists of the tags and estimates the cost of every node.
+     *
+     * @param node The node to resolve.
+     * @param tags The TagHashMap containing the tag posting lists.
+     * @param parent The type of the parent node.
+     * @return True if the node is valid, false otherwise.
+     */
+    bool resolve(TagQueryNode& node, TagHashMap& tags, TagQueryNode::Type parent) {
+        static const PostingList empty_list;
+        static const RoaringBitmap empty_bitmap;
+        if (node.type == TagQueryNode::TAG) {
+            TagVector* tag = tags.search(node.name);
+            node.list = tag ? &tag->vector : &empty_list;
+            node.bitmap = tag ? &tag->bitmap : &empty_bitmap;
+            node.cost = tag ? tag->count() : 0;
+            return true;
+        }
+        if (node.type == TagQueryNode::NOT && parent != TagQueryNode::AND) {
+            error = "NOT can only exclude players from an AND with other terms.";
+            return false;
+        }
+        bool positive = false;
+        for (auto& child : node.children) {
+            if (!resolve(child, tags, node.type)) {
+                return false;
+            }
+            positive = positive || child.type != TagQueryNode::NOT;
+        }
+        if (node.type == TagQueryNode::AND && !positive) {
+            error = "NOT can only exclude players from an AND with other terms.";
+            return false;
+        }
+
+        if (node.type == TagQueryNode::NOT) {
+            node.cost = node.children[0].cost;
+        }
+        else if (node.type == TagQueryNode::AND) {
+            node.cost = SIZE_MAX;
+            for (auto& child : node.children) {
+                if (child.type != TagQueryNode::NOT) {
+                    node.cost = std::min(node.cost, child.cost);
+                }
+            }
+        }
+        else {
+            node.cost = 0;
+            for (auto& child : node.children) {
+                node.cost += child.cost;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Returns the posting list of a node: tags are used in place, other nodes are
+     * evaluated into a temporary list.
+     *
+     * @param node The node to materialize.
+     * @param after Only IDs greater than this one are needed (negative for all).
+     * @param temporaries A reference to the storage of the evaluated lists.
+     * @return A pointer to the sorted posting list of the node.
+     */
+    const PostingList* materialize(const TagQueryNode& node, int64_t after, std::deque<PostingList>& temporaries) {
+        if (node.type == TagQueryNode::TAG) {
+            return node.list;
+        }
+        temporaries.emplace_back();
+        PostingList& list = temporaries.back();
+        visit(node, after, [&](uint32_t id) {
+            list.push_back(id);
+            return true;
+        });
+        return &list;
+    }
+
+    /**
+     * Visits the player IDs of a node in ascending order. The terms of the node are
+     * materialized, but the node itself is only intersected or merged as far as the
+     * visit goes.
+     *
+     * @param node The node to evaluate (TAG, AND or OR).
+     * @param after Only IDs greater than this one are visited (negative for all).
+     * @param function The function to call, as function(id); returning false stops the visit.
+     */
+    template <class Function>
+    void visit(const TagQueryNode& node, int64_t after, Function function) {
+        std::deque<PostingList> temporaries;
+        if (node.type == TagQueryNode::TAG) {
+            auto first = after < 0 ? node.list->begin()
+                : std::upper_bound(node.list->begin(), node.list->end(), static_cast<uint32_t>(after));
+            for (; first != node.list->end(); ++first) {
+                if (!function(*first)) {
+                    return;
+                }
+            }
+        }
+        else if (node.type == TagQueryNode::AND) {
+            // Terms are intersected smallest first, and excluded terms checked last,
+            // smallest first too
+            std::vector<const PostingList*> included;
+            std::vector<const TagQueryNode*> excluded_nodes;
+            for (auto& child : node.children) {
+                if (child.type == TagQueryNode::NOT) {
+                    excluded_nodes.push_back(&child.children[0]);
+                }
+                else {
+                    included.push_back(materialize(child, after, temporaries));
+                }
+            }
+            std::sort(excluded_nodes.begin(), excluded_nodes.end(), [](const TagQueryNode* a, const TagQueryNode* b) {
+                return a->cost < b->cost;
+            });
+            std::vector<const uint32_t*> positions;
+            std::vector<const uint32_t*> ends;
+            for (auto& excluded_node : excluded_nodes) {
+                const PostingList* excluded = materialize(*excluded_node, after, temporaries);
+                positions.push_back(excluded->data());
+                ends.push_back(excluded->data() + excluded->size());
+            }
+            intersect_postings(included, after, [&](uint32_t id) {
+                for (size_t i = 0; i < positions.size(); i++) {
+                    positions[i] = gallop(positions[i], ends[i], id);
+                    if (positions[i] != ends[i] && *positions[i] == id) {
+                        return true;
+                    }
+                }
+                return function(id);
+            });
+        }
+        else if (node.type == TagQueryNode::OR) {
+            // K-way merge of the terms, skipping repeated IDs
+            struct Head {
+                const uint32_t* position;
+                const uint32_t* end;
+            };
+            auto greater = [](const Head& a, const Head& b) {
+                return *a.position > *b.position;
+            };
+            std::priority_queue<Head, std::vector<Head>, decltype(greater)> heap(greater);
+            for (auto& child : node.children) {
+                const PostingList* list = materialize(child, after, temporaries);
+                const uint32_t* first = list->data();
+                const uint32_t* end = first + list->size();
+                if (after >= 0) {
+                    first = std::upper_bound(first, end, static_cast<uint32_t>(after));
+                }
+                if (first != end) {
+                    heap.push({ first, end });
+                }
+            }
+            bool visited = false;
+            uint32_t last_id = 0;
+            while (!heap.empty()) {
+                Head head = heap.top();
+                heap.pop();
+                if (!visited || last_id != *head.position) {
+                    if (!function(*head.position)) {
+                        return;
+                    }
+                    visited = true;
+                    last_id = *head.position;
+                }
+                if (++head.position != head.end) {
+                    heap.push(head);
+                }
+            }
+        }
+    }
+
+    /**
+     * Evaluates a node into a bitmap. Tags are used in place, other nodes are evaluated
+     * into a temporary bitmap.
+     *
+     * @param node The node to evaluate (TAG, AND or OR).
+     * @param temporaries A reference to the storage of the evaluated bitmaps.
+     * @return A pointer to the bitmap of the node.
+     */
+    const RoaringBitmap* evaluate_bitmap(const TagQueryNode& node, std::deque<RoaringBitmap>& temporaries) {
+        if (node.type == TagQueryNode::TAG) {
+            return node.bitmap;
+        }
+        std::vector<const TagQueryNode*> included;
+        std::vector<const TagQueryNode*> excluded;
+        for (auto& child : node.children) {
+            if (child.type == TagQueryNode::NOT) {
+                excluded.push_back(&child.children[0]);
+            }
+            else {
+                included.push_back(&child);
+            }
+        }
+        auto cheaper = [](const TagQueryNode* a, const TagQueryNode* b) {
+            return a->cost < b->cost;
+        };
+        std::sort(included.begin(), included.end(), cheaper);
+        std::sort(excluded.begin(), excluded.end(), cheaper);
+
+        const RoaringBitmap* result = evaluate_bitmap(*included[0], temporaries);
+        for (size_t i = 1; i < included.size(); i++) {
+            const RoaringBitmap* term = evaluate_bitmap(*included[i], temporaries);
+            temporaries.push_back(node.type == TagQueryNode::AND
+                ? RoaringBitmap::intersect(*result, *term)
+                : RoaringBitmap::unite(*result, *term));
+            result = &temporaries.back();
+        }
+        for (auto& term_node : excluded) {
+            const RoaringBitmap* term = evaluate_bitmap(*term_node, temporaries);
+            temporaries.push_back(RoaringBitmap::subtract(*result, *term));
+            result = &temporaries.back();
+        }
+        return result;
+    }
+
+    bool matches(const TagQueryNode& node, uint32_t player_id) const {
+        switch (node.type) {
+        case TagQueryNode::TAG:
+            return bitmaps ? node.bitmap->contains(player_id)
+                : std::binary_search(node.list->begin(), node.list->end(), player_id);
+        case TagQueryNode::NOT:
+            return !matches(node.children[0], player_id);
+        case TagQueryNode::AND:
+            for (auto& child : node.children) {
+                if (!matches(child, player_id)) {
+                    return false;
+                }
+            }
+            return true;
+        default:
+            for (auto& child : node.children) {
+                if (matches(child, player_id)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+    }
+
+    static std::string canonical(const TagQueryNode& node) {
+        if (node.type == TagQueryNode::TAG) {
+            return "'" + node.name + "'";
+        }
+        if (node.type == TagQueryNode::NOT) {
+            return "NOT " + canonical(node.children[0]);
+        }
+        std::vector<std::string> terms;
+        for (auto& child : node.children) {
+            terms.push_back(canonical(child));
+        }
+        std::sort(terms.begin(), terms.end());
+        std::string text = "(";
+        for (size_t i = 0; i < terms.size(); i++) {
+            text += (i ? (node.type == TagQueryNode::AND ? " AND " : " OR ") : "") + terms[i];
+        }
+        return text + ")";
+    }
+
+public:
+    /**
+     * Parses a query and resolves its tags.
+     *
+     * @param text The query text.
+     * @param tags The TagHashMap containing the tag posting lists.
+     * @return True if the query is valid, false otherwise (see get_error).
+     */
+    bool parse(const std::string& text, TagHashMap& tags) {
+        error.clear();
+        next_token = 0;
+        bitmaps = tags.bitmaps;
+        if (!tokenize(text)) {
+            return false;
+        }
+        if (peek().type == Token::END) {
+            error = "No tags were provided.";
+            return false;
+        }
+        root = TagQueryNode{ TagQueryNode::TAG };
+        if (!parse_or(root)) {
+            return false;
+        }
+        if (peek().type != Token::END) {
+            error = "Unexpected \"" + peek().text + "\".";
+            return false;
+        }
+        // A NOT at the root has nothing to exclude players from
+        return resolve(root, tags, TagQueryNode::OR);
+    }
+
+    /**
+     * Visits the players matching the query in ascending order, without materializing
+     * them: the top of the query is only intersected or merged as far as the visit goes.
+     *
+     * @param after Only IDs greater than this one are visited (negative for all).
+     * @param function The function to call, as function(id); returning false stops the visit.
+     */
+    template <class Function>
+    void for_each(int64_t after, Function function) {
+        if (bitmaps) {
+            std::deque<RoaringBitmap> temporaries;
+            evaluate_bitmap(root, temporaries)->for_each(after, function);
+        }
+        else {
+            visit(root, after, function);
+        }
+    }
+
+    /**
+     * Evaluates the query one page at a time.
+     *
+     * @param limit The maximum number of player IDs to return.
+     * @param cursor A reference to the continuation cursor (the last returned ID): when
+     *        not empty, the evaluation resumes after it. On return it holds the cursor
+     *        of the next page, or is empty if there are no more players.
+     * @return A vector containing up to limit player IDs, in ascending order.
+     */
+    std::vector<uint32_t> evaluate(size_t limit, PageCursor& cursor) {
+        int64_t after = cursor.empty() ? -1 : static_cast<int64_t>(cursor[0]);
+        std::vector<uint32_t> players;
+        bool more = false;
+        for_each(after, [&](uint32_t id) {
+            if (players.size() == limit) {
+                // At least one more player: the next page starts after the last one
+                more = true;
+                return false;
+            }
+            players.push_back(id);
+            return true;
+        });
+        cursor.clear();
+        if (more && limit > 0) {
+            cursor = { players.back() };
+        }
+        return players;
+    }
+
+    /**
+     * Checks whether a single player matches the query, probing the posting lists.
+     *
+     * @param player_id The ID of the player.
+     * @return True if the player matches the query, false otherwise.
+     */
+    bool matches(uint32_t player_id) const {
+        return matches(root, player_id);
+    }
+
+    /**
+     * Returns a normalized form of the query, which is the same for equivalent ways of
+     * writing it (terms of AND and OR are sorted, grouping and letter case of the
+     * operators are unified).
+     */
+    std::string canonical() const {
+        return canonical(root);
+    }
+
+    /**
+     * Returns the query tree, for inspection.
+     */
+    const TagQueryNode& get_root() const {
+        return root;
+    }
+
+    /**
+     * Returns the reason why the last parse failed.
+     */
+    const std::string& get_error() const {
+        return error;
+    }
+};
+
+#endif // TAG_QUERY_H
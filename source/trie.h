@@ -1,123 +1,1070 @@
 #ifndef TRIE_H
 #define TRIE_H
 
+#include <algorithm>
+#include <chrono>
 #include <iostream>
 #include <string>
+#include <utility>
 #include <vector>
 #include <cctype>
+#include <cstdint>
 #include "csv.h"
+#include "cursor.h"
+#include "parallel.h"
 
 #define ALPHABET_SIZE 26 + 5  // 26 letters plus 5 special characters
+#define MAX_LABEL_LENGTH 65535
+#define NO_NODE UINT32_MAX
+#define TOP_CACHE_SIZE 32  // Best players cached per node, for nodes with larger subtrees
+#define MAX_EDIT_DISTANCE 3  // Largest distance accepted by fuzzy searches
+#define DEFAULT_FUZZY_LIMIT 20
+#define PREFIX_BYTES 7  // Bytes of a name compared at once when building in bulk
+
+/**
+ * Path-compressed (radix) trie of player names. Chains of single-child characters are
+ * collapsed into one node whose edge label is a slice of a shared label pool, and all
+ * nodes live in one contiguous vector linked by index (first child, next sibling), so
+ * a prefix walk touches a handful of small nodes instead of one 31-pointer node per
+ * character. Letters are folded to upper case and siblings are kept in alphabet order
+ * (letters, then '"', '\'', '-', ' ' and '.', then any other byte), which gives the
+ * same result order as a trie with one link per character.
+ *
+ * Once ranked by a score (see rank_by), every node whose subtree holds more than
+ * TOP_CACHE_SIZE players also caches its best TOP_CACHE_SIZE players, so the best
+ * matches of a prefix are read in O(prefix length + k) however many names share it.
+ * Names are indexed byte by byte, so any UTF-8 name is accepted; fuzzy searches
+ * decode the labels back to characters to compute edit distances.
+ */
+struct NameMatch {
+    uint32_t player_id;
+    uint32_t distance;  // Edit distance between the searched text and the closest prefix of the name
+};
 
 class PlayerNameTrie {
 private:
-    PlayerNameTrie* links[ALPHABET_SIZE] = { 0 };
-    std::vector<uint32_t> player_ids;
+    struct Node {
+        uint32_t label = 0;            // Offset of the edge label in the label pool
+        uint32_t first_child = NO_NODE;
+        uint32_t next_sibling = NO_NODE;
+        uint32_t first_id = NO_NODE;      // First entry of the player IDs ending at this node
+        uint32_t subtree_count = 0;    // Number of player IDs in this subtree
+        uint16_t length = 0;           // Length of the edge label
+        unsigned char first = 0;       // First character of the label, so children are picked without reading the pool
+    };
 
-    /**
-     * Recursively traverses the trie and gathers player IDs.
-     *
-     * @param id_vector The vector to store gathered IDs.
-     */
-    void gather_ids(std::vector<uint32_t>& id_vector) {
-        if (!(this->player_ids.empty())) {
-            // Concatenate both vectors
-            id_vector.insert(
-                id_vector.end(), this->player_ids.begin(), this->player_ids.end()
-            );
+    struct IdEntry {
+        uint32_t id;
+        uint32_t next;
+        double score;
+    };
+
+    struct ScoredId {
+        double score;
+        uint32_t id;
+    };
+
+    struct FuzzyCandidate {
+        uint32_t distance;
+        ScoredId player;
+    };
+
+    struct FuzzyQuery {
+        std::vector<uint32_t> characters;  // Characters of the text, decoded from UTF-8
+        uint32_t max_distance;
+        size_t limit;
+        std::vector<FuzzyCandidate> candidates;
+    };
+
+    struct FuzzyState {
+        std::vector<uint32_t> row;  // Last row of the edit distance table
+        uint32_t best;              // Smallest distance of a prefix so far (max_distance + 1 if none)
+        uint32_t value = 0;         // Character being decoded
+        int remaining = 0;          // Bytes missing from the character being decoded
+    };
+
+    // Layout of the one-node-per-character trie, for the memory report
+    struct CharacterNode {
+        CharacterNode* links[ALPHABET_SIZE];
+        std::vector<uint32_t> player_ids;
+        uint32_t subtree_count;
+    };
+
+    // Names being built in bulk, folded and mapped to their alphabet positions
+    struct KeyPool {
+        std::string text;
+        std::vector<uint32_t> starts;  // Offset of every name in the text, plus the end of the text
+        char characters[256];          // Folded character at every alphabet position
+
+        size_t length(uint32_t key) const {
+            return starts[key + 1] - starts[key];
+        }
+
+        unsigned char at(uint32_t key, size_t index) const {
+            return static_cast<unsigned char>(text[starts[key] + index]);
         }
-        for (int i = 0; i < ALPHABET_SIZE; i++) {
-            if (links[i]) {
-                links[i]->gather_ids(id_vector);
+
+        // PREFIX_BYTES bytes from a depth, packed big-endian, then how many of them the key has
+        // (PREFIX_BYTES + 1 if it goes on), so a key sorts before the keys it is a prefix of
+        uint64_t prefix(uint32_t key, size_t depth) const {
+            size_t count = std::min<size_t>(length(key) - std::min(depth, length(key)), PREFIX_BYTES + 1);
+            uint64_t prefix = 0;
+            for (size_t i = 0; i < PREFIX_BYTES; i++) {
+                prefix = prefix << 8 | (i < count ? at(key, depth + i) : 0);
             }
+            return prefix << 8 | count;
         }
+    };
+
+    std::vector<Node> nodes;     // Node 0 is the root, with an empty label
+    std::vector<IdEntry> ids;    // Player IDs of every node, chained in insertion order
+    std::string labels;          // Edge labels, folded to upper case
+    std::vector<uint32_t> top_slot;     // Per node, index of its cached best players in top_entries (NO_NODE if not cached)
+    std::vector<ScoredId> top_entries;  // TOP_CACHE_SIZE entries per cached node, best first
+
+    /**
+     * Folds a character the way names are compared.
+     *
+     * @param c The character to fold.
+     * @return The folded character.
+     */
+    static unsigned char fold(char c) {
+        return static_cast<unsigned char>(toupper(static_cast<unsigned char>(c)));
     }
 
     /**
-     * Converts an ASCII character to its corresponding alphabet index.
+     * Converts a folded character to its position in the alphabet order.
      *
-     * @param c The ASCII character to convert.
+     * @param c The folded character to convert.
      * @return The alphabet index.
      */
-    int ascii_to_alphabet(char c) {
+    static uint32_t ascii_to_alphabet(unsigned char c) {
         switch (c) {
         case '"': return ALPHABET_SIZE - 5;
         case '\'': return ALPHABET_SIZE - 4;
         case '-': return ALPHABET_SIZE - 3;
         case ' ': return ALPHABET_SIZE - 2;
         case '.': return ALPHABET_SIZE - 1;
-        default: return int(toupper(c)) - 65;
+        default: return c >= 'A' && c <= 'Z' ? c - 'A' : ALPHABET_SIZE + c;
+        }
+    }
+
+    /**
+     * Converts an alphabet index back to its folded character.
+     *
+     * @param index The alphabet index to convert.
+     * @param c A reference to the character that receives the result.
+     * @return True if the index is valid, false otherwise.
+     */
+    static bool alphabet_to_ascii(uint32_t index, unsigned char& c) {
+        const char* special = "\"'- .";
+        if (index < 26) {
+            c = static_cast<unsigned char>('A' + index);
+        }
+        else if (index < ALPHABET_SIZE) {
+            c = static_cast<unsigned char>(special[index - 26]);
+        }
+        else if (index < ALPHABET_SIZE + 256) {
+            c = static_cast<unsigned char>(index - ALPHABET_SIZE);
+        }
+        else {
+            return false;
+        }
+        return ascii_to_alphabet(c) == index;
+    }
+
+    /**
+     * Folds every character of a name.
+     *
+     * @param name The name to fold.
+     * @return The folded key.
+     */
+    static std::string fold(const std::string& name) {
+        std::string key(name.size(), '\0');
+        for (size_t i = 0; i < name.size(); i++) {
+            key[i] = static_cast<char>(fold(name[i]));
+        }
+        return key;
+    }
+
+    /**
+     * Finds the child of a node whose label starts with a character.
+     *
+     * @param node The parent node.
+     * @param c The folded character.
+     * @return The index of the child, or NO_NODE if there is none.
+     */
+    uint32_t find_child(uint32_t node, unsigned char c) const {
+        uint32_t index = ascii_to_alphabet(c);
+        for (uint32_t child = nodes[node].first_child; child != NO_NODE; child = nodes[child].next_sibling) {
+            uint32_t child_index = ascii_to_alphabet(nodes[child].first);
+            if (child_index >= index) {
+                return child_index == index ? child : NO_NODE;
+            }
+        }
+        return NO_NODE;
+    }
+
+    /**
+     * Follows a key from the root.
+     *
+     * @param key The folded key to follow.
+     * @param depth A reference that receives the length of the key at the end of the
+     *        label of the node reached (at least the length of the key).
+     * @param path If not null, receives the nodes followed, starting with the root.
+     * @return The node whose label contains the end of the key, or NO_NODE if no name
+     *         starts with the key.
+     */
+    uint32_t locate(const std::string& key, size_t& depth, std::vector<uint32_t>* path = nullptr) const {
+        uint32_t node = 0;
+        depth = 0;
+        if (path) {
+            path->assign(1, 0);
+        }
+        while (depth < key.size()) {
+            uint32_t child = find_child(node, static_cast<unsigned char>(key[depth]));
+            if (child == NO_NODE) {
+                return NO_NODE;
+            }
+            const Node& edge = nodes[child];
+            for (size_t i = 1; i < edge.length && depth + i < key.size(); i++) {
+                if (labels[edge.label + i] != key[depth + i]) {
+                    return NO_NODE;
+                }
+            }
+            node = child;
+            depth += edge.length;
+            if (path) {
+                path->push_back(node);
+            }
+        }
+        return node;
+    }
+
+    /**
+     * Splits the label of a node, moving its tail, children and IDs to a new child.
+     *
+     * @param node The node to split.
+     * @param length The length of the label kept by the node.
+     */
+    void split(uint32_t node, uint16_t length) {
+        Node lower;
+        lower.label = nodes[node].label + length;
+        lower.length = nodes[node].length - length;
+        lower.first = static_cast<unsigned char>(labels[lower.label]);
+        lower.first_child = nodes[node].first_child;
+        lower.first_id = nodes[node].first_id;
+        lower.subtree_count = nodes[node].subtree_count;
+        nodes.push_back(lower);
+        nodes[node].length = length;
+        nodes[node].first_child = static_cast<uint32_t>(nodes.size() - 1);
+        nodes[node].first_id = NO_NODE;
+    }
+
+    /**
+     * Visits the player IDs of a subtree in trie order: the IDs of a node, then the
+     * subtrees of its children in alphabet order.
+     *
+     * @param stack The nodes from the root of the subtree down to the node where the
+     *        visit starts. On return it holds the node being visited when stopped.
+     * @param next_id The index of the first ID to visit in the node where the visit starts.
+     * @param function The function to call, as function(entry, index of the entry in its
+     *        node); returning false stops the visit.
+     */
+    template <class Function>
+    void walk(std::vector<uint32_t>& stack, size_t next_id, Function function) const {
+        while (true) {
+            const Node& node = nodes[stack.back()];
+            uint32_t entry = node.first_id;
+            size_t index = 0;
+            for (; entry != NO_NODE && index < next_id; index++) {
+                entry = ids[entry].next;
+            }
+            for (; entry != NO_NODE; entry = ids[entry].next, index++) {
+                if (!function(ids[entry], index)) {
+                    return;
+                }
+            }
+            next_id = 0;
+            if (node.first_child != NO_NODE) {
+                stack.push_back(node.first_child);
+                continue;
+            }
+            // Subtree finished: continue with the next sibling of the deepest node having one
+            while (stack.size() > 1 && nodes[stack.back()].next_sibling == NO_NODE) {
+                stack.pop_back();
+            }
+            if (stack.size() == 1) {
+                return;
+            }
+            stack.back() = nodes[stack.back()].next_sibling;
+        }
+    }
+
+    /**
+     * Orders players by descending score, then by ascending ID.
+     */
+    static bool better(const ScoredId& a, const ScoredId& b) {
+        return a.score > b.score || (a.score == b.score && a.id < b.id);
+    }
+
+    /**
+     * Gathers the players of a subtree with their scores.
+     *
+     * @param node The root of the subtree.
+     * @param scored A reference to the vector the players are appended to.
+     */
+    void gather_scored(uint32_t node, std::vector<ScoredId>& scored) const {
+        std::vector<uint32_t> stack = { node };
+        walk(stack, 0, [&](const IdEntry& entry, size_t) {
+            scored.push_back({ entry.score, entry.id });
+            return true;
+        });
+    }
+
+    /**
+     * Adds a player ID after the IDs already at a node.
+     *
+     * @param node The node where the name of the player ends.
+     * @param player_id The sofifa_id of the player.
+     */
+    void append_id(uint32_t node, uint32_t player_id) {
+        ids.push_back({ player_id, NO_NODE, 0 });
+        uint32_t entry = static_cast<uint32_t>(ids.size() - 1);
+        if (nodes[node].first_id == NO_NODE) {
+            nodes[node].first_id = entry;
+        }
+        else {
+            uint32_t last = nodes[node].first_id;
+            while (ids[last].next != NO_NODE) {
+                last = ids[last].next;
+            }
+            ids[last].next = entry;
+        }
+    }
+
+    /**
+     * Returns the position of every byte in the alphabet order. Bytes outside the
+     * alphabet keep their relative order, so the 256 positions fit in a byte.
+     */
+    static const unsigned char* alphabet_order() {
+        static const std::vector<unsigned char> order = [] {
+            std::vector<std::pair<uint32_t, unsigned>> ranked;
+            for (unsigned c = 0; c < 256; c++) {
+                ranked.push_back({ ascii_to_alphabet(static_cast<unsigned char>(c)), c });
+            }
+            std::sort(ranked.begin(), ranked.end());
+            std::vector<unsigned char> order(256);
+            for (unsigned i = 0; i < 256; i++) {
+                order[ranked[i].second] = static_cast<unsigned char>(i);
+            }
+            return order;
+        }();
+        return order.data();
+    }
+
+    /**
+     * Sorts keys by their first prefixes with a stable radix sort, one byte at a time from
+     * the last, so keys sharing a prefix keep their order.
+     *
+     * @param prefixes The prefix of every key, with its index.
+     */
+    static void sort_prefixes(std::vector<std::pair<uint64_t, uint32_t>>& prefixes) {
+        std::vector<std::pair<uint64_t, uint32_t>> buffer(prefixes.size());
+        std::vector<size_t> counts(8 * 256);  // Start of every byte value, for the 8 bytes
+        for (auto& prefix : prefixes) {
+            for (int byte = 0; byte < 8; byte++) {
+                counts[byte * 256 + (prefix.first >> (8 * byte) & 0xFF)]++;
+            }
+        }
+        for (int byte = 0; byte < 8; byte++) {
+            size_t* start = &counts[byte * 256];
+            if (prefixes.empty() || start[prefixes[0].first >> (8 * byte) & 0xFF] == prefixes.size()) {
+                continue;  // Every key has the same byte here
+            }
+            for (size_t value = 0, position = 0; value < 256; value++) {
+                size_t count = start[value];
+                start[value] = position;
+                position += count;
+            }
+            for (auto& prefix : prefixes) {
+                buffer[start[prefix.first >> (8 * byte) & 0xFF]++] = prefix;
+            }
+            prefixes.swap(buffer);
+        }
+    }
+
+    /**
+     * Sorts the runs of keys that share a prefix and go on past it by their next prefixes.
+     * Ties are broken by index, the order equal keys had before.
+     *
+     * @param prefixes The prefix of every key at the given depth, with its index.
+     * @param first The first position of the range to sort.
+     * @param last The position after the last one of the range to sort.
+     * @param depth The depth of the prefixes.
+     * @param keys The keys.
+     */
+    static void sort_runs(std::vector<std::pair<uint64_t, uint32_t>>& prefixes, size_t first, size_t last,
+        size_t depth, const KeyPool& keys) {
+        while (first < last) {
+            size_t end = first + 1;
+            while (end < last && prefixes[end].first == prefixes[first].first) {
+                end++;
+            }
+            if (end - first > 1 && (prefixes[first].first & 0xFF) > PREFIX_BYTES) {
+                for (size_t i = first; i < end; i++) {
+                    prefixes[i].first = keys.prefix(prefixes[i].second, depth + PREFIX_BYTES);
+                }
+                std::sort(prefixes.begin() + first, prefixes.begin() + end);
+                sort_runs(prefixes, first, end, depth + PREFIX_BYTES, keys);
+            }
+            first = end;
+        }
+    }
+
+    /**
+     * Builds an empty trie from non-empty names sorted by their first prefixes, in one
+     * pass once the names sharing a prefix are sorted: the nodes on the path of the
+     * previous name are kept in a stack, and every name pops the nodes beyond its common
+     * prefix with the previous one, splits the label where the prefix ends, and adds its
+     * remaining characters as the last child.
+     *
+     * @param names The names of the players with their sofifa_id's.
+     * @param keys The folded names, mapped to the alphabet order.
+     * @param prefixes The first prefixes of the keys with their indexes, sorted. The
+     *        range built from ends up sorted by key.
+     * @param first The first position of prefixes to build from.
+     * @param last The position of prefixes after the last one to build from.
+     */
+    void build_sorted(const std::vector<std::pair<std::string, uint32_t>>& names, const KeyPool& keys,
+        std::vector<std::pair<uint64_t, uint32_t>>& prefixes, size_t first, size_t last) {
+        sort_runs(prefixes, first, last, 0, keys);
+        struct Frame {
+            uint32_t node;
+            size_t depth;         // Length of the name at the start of the label
+            uint32_t last_child;
+        };
+        std::vector<Frame> stack = { { 0, 0, NO_NODE } };
+        for (size_t i = first; i < last; i++) {
+            uint32_t key = prefixes[i].second;
+            size_t length = keys.length(key);
+            size_t common = 0;
+            if (i > first) {
+                uint32_t previous = prefixes[i - 1].second;
+                size_t shorter = std::min(length, keys.length(previous));
+                while (common < shorter && keys.at(key, common) == keys.at(previous, common)) {
+                    common++;
+                }
+            }
+            while (stack.size() > 1 && stack.back().depth >= common) {
+                stack.pop_back();
+            }
+            if (common < stack.back().depth + nodes[stack.back().node].length) {
+                split(stack.back().node, static_cast<uint16_t>(common - stack.back().depth));
+                stack.back().last_child = nodes[stack.back().node].first_child;
+            }
+
+            // Sorted names only add children after the existing ones
+            for (size_t depth = common; depth < length;) {
+                Node leaf;
+                leaf.label = static_cast<uint32_t>(labels.size());
+                leaf.length = static_cast<uint16_t>(std::min<size_t>(length - depth, MAX_LABEL_LENGTH));
+                for (size_t j = depth; j < depth + leaf.length; j++) {
+                    labels.push_back(keys.characters[keys.at(key, j)]);
+                }
+                leaf.first = static_cast<unsigned char>(labels[leaf.label]);
+                nodes.push_back(leaf);
+                uint32_t child = static_cast<uint32_t>(nodes.size() - 1);
+                Frame& parent = stack.back();
+                if (parent.last_child == NO_NODE) {
+                    nodes[parent.node].first_child = child;
+                }
+                else {
+                    nodes[parent.last_child].next_sibling = child;
+                }
+                parent.last_child = child;
+                stack.push_back({ child, depth, NO_NODE });
+                depth += leaf.length;
+            }
+            append_id(stack.back().node, names[key].second);
+            for (auto& frame : stack) {
+                nodes[frame.node].subtree_count++;
+            }
+        }
+    }
+
+    /**
+     * Gathers the best players of a subtree, from its cache when it has one.
+     *
+     * @param node The root of the subtree.
+     * @param k The maximum number of players to gather.
+     * @param scored A reference to the vector the players are appended to, best first.
+     */
+    void best_of(uint32_t node, size_t k, std::vector<ScoredId>& scored) const {
+        if (k <= TOP_CACHE_SIZE && !top_slot.empty() && top_slot[node] != NO_NODE) {
+            auto first = top_entries.begin() + top_slot[node];
+            scored.insert(scored.end(), first, first + k);
+            return;
+        }
+        // Small subtrees, or more players than cached
+        size_t start = scored.size();
+        gather_scored(node, scored);
+        k = std::min(k, scored.size() - start);
+        std::partial_sort(scored.begin() + start, scored.begin() + start + k, scored.end(), better);
+        scored.resize(start + k);
+    }
+
+    /**
+     * Reads one byte of UTF-8 text.
+     *
+     * @param byte The byte to read.
+     * @param value A reference to the character being decoded.
+     * @param remaining A reference to the number of bytes missing from the character.
+     * @return True if the byte completes a character, false otherwise. Bytes that do
+     *         not form a valid sequence are returned as characters of their own.
+     */
+    static bool decode(unsigned char byte, uint32_t& value, int& remaining) {
+        if (remaining > 0 && (byte & 0xC0) == 0x80) {
+            value = (value << 6) | (byte & 0x3F);
+            return --remaining == 0;
+        }
+        remaining = 0;
+        if ((byte & 0xE0) == 0xC0) {
+            value = byte & 0x1F;
+            remaining = 1;
+        }
+        else if ((byte & 0xF0) == 0xE0) {
+            value = byte & 0x0F;
+            remaining = 2;
+        }
+        else if ((byte & 0xF8) == 0xF0) {
+            value = byte & 0x07;
+            remaining = 3;
+        }
+        else {
+            value = byte;
+        }
+        return remaining == 0;
+    }
+
+    /**
+     * Visits a subtree for a fuzzy search.
+     *
+     * @param node The root of the subtree.
+     * @param state The edit distances of the name prefix leading to the node (copied,
+     *        since siblings start from the same state).
+     * @param query The fuzzy search, which receives the candidates.
+     */
+    void fuzzy_walk(uint32_t node, FuzzyState state, FuzzyQuery& query) const {
+        const std::vector<uint32_t>& characters = query.characters;
+        std::vector<uint32_t>& row = state.row;
+        const Node& current = nodes[node];
+        for (size_t i = 0; i < current.length; i++) {
+            if (!decode(static_cast<unsigned char>(labels[current.label + i]), state.value, state.remaining)) {
+                continue;
+            }
+            uint32_t c = state.value;
+            // Next row of the edit distance table: row[j] is the distance between the
+            // name prefix and the first j characters of the text
+            uint32_t diagonal = row[0];
+            row[0]++;
+            uint32_t lowest = row[0];
+            for (size_t j = 1; j < row.size(); j++) {
+                uint32_t above = row[j];
+                row[j] = std::min(std::min(above, row[j - 1]) + 1, diagonal + (characters[j - 1] != c));
+                diagonal = above;
+                lowest = std::min(lowest, row[j]);
+            }
+            state.best = std::min(state.best, row.back());
+            if (lowest >= state.best) {
+                // No name in the subtree can get closer than this prefix
+                if (state.best <= query.max_distance) {
+                    std::vector<ScoredId> scored;
+                    best_of(node, query.limit, scored);
+                    for (auto& player : scored) {
+                        query.candidates.push_back({ state.best, player });
+                    }
+                }
+                return;
+            }
+        }
+
+        if (state.best <= query.max_distance) {
+            for (uint32_t entry = current.first_id; entry != NO_NODE; entry = ids[entry].next) {
+                query.candidates.push_back({ state.best, { ids[entry].score, ids[entry].id } });
+            }
+        }
+        for (uint32_t child = current.first_child; child != NO_NODE; child = nodes[child].next_sibling) {
+            fuzzy_walk(child, state, query);
         }
     }
 
+    /**
+     * Recomputes the cached best players of a node from its own players and the best
+     * players of its children (whole subtrees for children without a cache).
+     *
+     * @param node The node, which must have a cache slot.
+     */
+    void compute_top(uint32_t node) {
+        std::vector<ScoredId> candidates;
+        for (uint32_t entry = nodes[node].first_id; entry != NO_NODE; entry = ids[entry].next) {
+            candidates.push_back({ ids[entry].score, ids[entry].id });
+        }
+        for (uint32_t child = nodes[node].first_child; child != NO_NODE; child = nodes[child].next_sibling) {
+            if (top_slot[child] != NO_NODE) {
+                auto first = top_entries.begin() + top_slot[child];
+                candidates.insert(candidates.end(), first, first + TOP_CACHE_SIZE);
+            }
+            else {
+                gather_scored(child, candidates);
+            }
+        }
+        std::partial_sort(candidates.begin(), candidates.begin() + TOP_CACHE_SIZE, candidates.end(), better);
+        std::copy(candidates.begin(), candidates.begin() + TOP_CACHE_SIZE, top_entries.begin() + top_slot[node]);
+    }
+
 public:
+    double build_seconds = 0;  // Time spent by the last bulk build, after reading the names
+
+    PlayerNameTrie() {
+        nodes.push_back(Node());
+    }
+
     /**
-     * Inserts a player's name into the trie along with the corresponding player's
-     * sofifa_id at the leaf node.
+     * Replaces the contents of the trie with a list of names, building it in bulk: the
+     * folded names are sorted, and the subtree of every first character is then built
+     * bottom-up in a single pass over its names (in parallel with the others), since
+     * each name only shares a prefix with the names right before it. Players with the
+     * same name keep the order of the list.
      *
-     * @param player_name The name of the player to be inserted.
-     * @param player_id The sofifa_id associated with the player.
+     * @param names The names of the players with their sofifa_id's.
+     * @param threads The number of threads to use (0 uses the hardware concurrency).
      */
-    void insert(std::string player_name, uint32_t player_id) {
-        PlayerNameTrie* ptr = this;
-        for (auto& c : player_name) {
-            int i = this->ascii_to_alphabet(c);
-            if (!ptr->links[i]) {
-                ptr->links[i] = new PlayerNameTrie;
+    void build(const std::vector<std::pair<std::string, uint32_t>>& names, unsigned threads = 0) {
+        auto start = std::chrono::steady_clock::now();
+        nodes.assign(1, Node());
+        ids.clear();
+        labels.clear();
+        top_slot.clear();
+        top_entries.clear();
+
+        // Keys are pooled with every byte mapped to its alphabet position, so that comparing
+        // them bytewise follows the alphabet order
+        const unsigned char* order = alphabet_order();
+        unsigned char positions[256];
+        KeyPool keys;
+        for (unsigned c = 0; c < 256; c++) {
+            positions[c] = order[fold(static_cast<char>(c))];
+            keys.characters[order[c]] = static_cast<char>(c);
+        }
+        size_t total = 0;
+        for (auto& name : names) {
+            total += name.first.size();
+        }
+        keys.text.resize(total);
+        keys.starts.resize(names.size() + 1);
+        std::vector<std::pair<uint64_t, uint32_t>> prefixes(names.size());  // Prefix and index of every key
+        size_t offset = 0;
+        for (size_t i = 0; i < names.size(); i++) {
+            keys.starts[i] = static_cast<uint32_t>(offset);
+            for (auto& c : names[i].first) {
+                keys.text[offset++] = static_cast<char>(positions[static_cast<unsigned char>(c)]);
+            }
+        }
+        keys.starts[names.size()] = static_cast<uint32_t>(offset);
+        for (size_t i = 0; i < names.size(); i++) {
+            prefixes[i] = { keys.prefix(static_cast<uint32_t>(i), 0), static_cast<uint32_t>(i) };
+        }
+
+        sort_prefixes(prefixes);
+
+        // Names without characters stay at the root, the rest are grouped by first character
+        std::vector<size_t> bounds = { 0 };
+        while (bounds.back() < prefixes.size() && keys.length(prefixes[bounds.back()].second) == 0) {
+            append_id(0, names[prefixes[bounds.back()].second].second);
+            nodes[0].subtree_count++;
+            bounds.back()++;
+        }
+        for (size_t i = bounds.back() + 1; i <= prefixes.size(); i++) {
+            if (i == prefixes.size() || keys.at(prefixes[i].second, 0) != keys.at(prefixes[i - 1].second, 0)) {
+                bounds.push_back(i);
             }
-            ptr = ptr->links[i];
         }
-        ptr->player_ids.push_back(player_id);
+
+        if ((threads ? threads : default_thread_count()) <= 1 || bounds.size() <= 2) {
+            build_sorted(names, keys, prefixes, bounds.front(), prefixes.size());
+            build_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            return;
+        }
+        std::vector<PlayerNameTrie> parts(bounds.size() - 1);
+        parallel_for(parts.size(), [&](size_t g, unsigned) {
+            parts[g].build_sorted(names, keys, prefixes, bounds[g], bounds[g + 1]);
+        }, threads);
+        size_t node_total = nodes.size(), id_total = ids.size(), label_total = 0;
+        for (auto& part : parts) {
+            node_total += part.nodes.size() - 1;
+            id_total += part.ids.size();
+            label_total += part.labels.size();
+        }
+        nodes.reserve(node_total);
+        ids.reserve(id_total);
+        labels.reserve(label_total);
+
+        // Append the subtrees in order, moving their indexes past the nodes already placed
+        uint32_t last_child = NO_NODE;
+        for (auto& part : parts) {
+            uint32_t node_offset = static_cast<uint32_t>(nodes.size() - 1);  // The root of the part is dropped
+            uint32_t label_offset = static_cast<uint32_t>(labels.size());
+            uint32_t id_offset = static_cast<uint32_t>(ids.size());
+            for (size_t i = 1; i < part.nodes.size(); i++) {
+                Node node = part.nodes[i];
+                node.label += label_offset;
+                node.first_child = node.first_child == NO_NODE ? NO_NODE : node.first_child + node_offset;
+                node.next_sibling = node.next_sibling == NO_NODE ? NO_NODE : node.next_sibling + node_offset;
+                node.first_id = node.first_id == NO_NODE ? NO_NODE : node.first_id + id_offset;
+                nodes.push_back(node);
+            }
+            for (auto& entry : part.ids) {
+                ids.push_back({ entry.id, entry.next == NO_NODE ? NO_NODE : entry.next + id_offset, entry.score });
+            }
+            labels += part.labels;
+            // Every part has a single child at the root, for its first character
+            uint32_t child = part.nodes[0].first_child + node_offset;
+            if (last_child == NO_NODE) {
+                nodes[0].first_child = child;
+            }
+            else {
+                nodes[last_child].next_sibling = child;
+            }
+            last_child = child;
+            nodes[0].subtree_count += part.nodes[0].subtree_count;
+        }
+        build_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
     }
 
     /**
-     * Searches for players whose names have a given prefix and returns a vector
-     * containing their respective sofifa_id's.
+     * Visits the players whose names have a given prefix, in trie order (names in
+     * alphabet order, then players of the same name in the order they were added),
+     * without materializing them. Only the part of the subtree visited is walked.
      *
      * @param prefix The prefix to search for in player names.
-     * @return A vector containing the sofifa_id's of players whose names match the
-     *         given prefix.
+     * @param function The function to call, as function(id); returning false stops the visit.
+     */
+    template <class Function>
+    void for_each(const std::string& prefix, Function function) const {
+        size_t depth;
+        uint32_t node = locate(fold(prefix), depth);
+        if (node == NO_NODE) {
+            return;
+        }
+        std::vector<uint32_t> stack = { node };
+        walk(stack, 0, [&](const IdEntry& entry, size_t) {
+            return function(entry.id);
+        });
+    }
+
+    /**
+     * Counts the players whose names have a given prefix, in O(prefix length).
+     *
+     * @param prefix The prefix to search for in player names.
+     * @return The number of players whose names match the prefix.
+     */
+    size_t count(std::string prefix) const {
+        size_t depth;
+        uint32_t node = locate(fold(prefix), depth);
+        return node == NO_NODE ? 0 : nodes[node].subtree_count;
+    }
+
+    /**
+     * Checks whether a name has a given prefix, with the same letter case folding
+     * as the searches of the trie.
+     *
+     * @param name The name of a player.
+     * @param prefix The prefix to check.
+     * @return True if the name starts with the prefix, false otherwise.
      */
-    std::vector<uint32_t> search(std::string prefix) {
-        PlayerNameTrie* ptr = this;
-        // Search the prefix on the trie
-        for (auto& c : prefix) {
-            int i = this->ascii_to_alphabet(c);
-            if (!ptr->links[i]) {
-                return std::vector<uint32_t>();
+    static bool has_prefix(const std::string& name, const std::string& prefix) {
+        if (name.size() < prefix.size()) {
+            return false;
+        }
+        for (size_t i = 0; i < prefix.size(); i++) {
+            if (fold(name[i]) != fold(prefix[i])) {
+                return false;
             }
-            ptr = ptr->links[i];
         }
-        // Generate a list with all players on the prefix subtree
+        return true;
+    }
+
+    /**
+     * Searches for players whose names have a given prefix, one page at a time. Only
+     * the part of the prefix subtree needed for the page is visited.
+     *
+     * @param prefix The prefix to search for in player names.
+     * @param limit The maximum number of sofifa_id's to return.
+     * @param cursor A reference to the continuation cursor: when not empty, the search
+     *        resumes after the page that produced it. On return it holds the cursor of
+     *        the next page, or is empty if there are no more players.
+     * @return A vector containing up to limit sofifa_id's, in the same order as for_each.
+     */
+    std::vector<uint32_t> search(std::string prefix, size_t limit, PageCursor& cursor) {
         std::vector<uint32_t> id_vector;
-        ptr->gather_ids(id_vector);
+        std::string key = fold(prefix);
+        size_t root_depth;
+        uint32_t root = locate(key, root_depth);
+        if (root == NO_NODE) {
+            cursor.clear();
+            return id_vector;
+        }
+
+        // The cursor holds the alphabet indexes of the characters of the last returned
+        // name below the prefix, then the index of its ID in the node where it ends
+        std::vector<uint32_t> stack = { root };
+        size_t next_id = 0;
+        if (!cursor.empty()) {
+            std::string last_key = key;
+            for (size_t k = 0; k + 1 < cursor.size(); k++) {
+                unsigned char c;
+                if (!alphabet_to_ascii(cursor[k], c)) {
+                    cursor.clear();
+                    return id_vector;
+                }
+                last_key.push_back(static_cast<char>(c));
+            }
+            size_t depth;
+            std::vector<uint32_t> path;
+            if (last_key.size() < root_depth || locate(last_key, depth, &path) == NO_NODE || depth != last_key.size()) {
+                cursor.clear();
+                return id_vector;
+            }
+            stack.assign(std::find(path.begin(), path.end(), root), path.end());
+            next_id = cursor.back() + size_t(1);
+        }
+
+        std::vector<uint32_t> last;
+        size_t last_index = 0;
+        bool more = false;
+        walk(stack, next_id, [&](const IdEntry& entry, size_t index) {
+            if (id_vector.size() == limit) {
+                // At least one more player: the next page starts after the last one
+                more = true;
+                return false;
+            }
+            id_vector.push_back(entry.id);
+            if (id_vector.size() == limit) {
+                last = stack;
+                last_index = index;
+            }
+            return true;
+        });
+
+        cursor.clear();
+        if (more && limit > 0) {
+            // The rest of the label of the root below the prefix, then the labels below it
+            const Node& top = nodes[root];
+            for (size_t i = top.length - (root_depth - key.size()); i < top.length; i++) {
+                cursor.push_back(ascii_to_alphabet(static_cast<unsigned char>(labels[top.label + i])));
+            }
+            for (size_t k = 1; k < last.size(); k++) {
+                const Node& node = nodes[last[k]];
+                for (size_t i = 0; i < node.length; i++) {
+                    cursor.push_back(ascii_to_alphabet(static_cast<unsigned char>(labels[node.label + i])));
+                }
+            }
+            cursor.push_back(static_cast<uint32_t>(last_index));
+        }
+        return id_vector;
+    }
+
+    /**
+     * Scores every player and caches the best players of every node whose subtree
+     * holds more than TOP_CACHE_SIZE players.
+     *
+     * @param score The function giving the score of a player, as score(id).
+     */
+    template <class Score>
+    void rank_by(Score score) {
+        for (auto& entry : ids) {
+            entry.score = score(entry.id);
+        }
+        top_slot.assign(nodes.size(), NO_NODE);
+        top_entries.clear();
+
+        // Children are computed before their parents
+        std::vector<std::pair<uint32_t, bool>> stack;
+        if (nodes[0].subtree_count > TOP_CACHE_SIZE) {
+            stack.push_back({ 0, false });
+        }
+        while (!stack.empty()) {
+            uint32_t node = stack.back().first;
+            if (stack.back().second) {
+                stack.pop_back();
+                top_slot[node] = static_cast<uint32_t>(top_entries.size());
+                top_entries.resize(top_entries.size() + TOP_CACHE_SIZE);
+                compute_top(node);
+                continue;
+            }
+            stack.back().second = true;
+            for (uint32_t child = nodes[node].first_child; child != NO_NODE; child = nodes[child].next_sibling) {
+                if (nodes[child].subtree_count > TOP_CACHE_SIZE) {
+                    stack.push_back({ child, false });
+                }
+            }
+        }
+    }
+
+    /**
+     * Changes the score of a player, refreshing the cached best players along its name.
+     *
+     * @param player_name The name of the player.
+     * @param player_id The sofifa_id of the player.
+     * @param score The new score.
+     * @return True if the player was found, false otherwise.
+     */
+    bool update_score(const std::string& player_name, uint32_t player_id, double score) {
+        std::string key = fold(player_name);
+        size_t depth;
+        std::vector<uint32_t> path;
+        uint32_t node = locate(key, depth, &path);
+        if (node == NO_NODE || depth != key.size()) {
+            return false;
+        }
+        uint32_t entry = nodes[node].first_id;
+        while (entry != NO_NODE && ids[entry].id != player_id) {
+            entry = ids[entry].next;
+        }
+        if (entry == NO_NODE) {
+            return false;
+        }
+        ids[entry].score = score;
+        if (!top_slot.empty()) {
+            for (auto it = path.rbegin(); it != path.rend(); it++) {
+                if (top_slot[*it] != NO_NODE) {
+                    compute_top(*it);
+                }
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Searches for the best players whose names have a given prefix.
+     *
+     * @param prefix The prefix to search for in player names.
+     * @param k The maximum number of sofifa_id's to return.
+     * @return A vector containing up to k sofifa_id's, by descending score and then by
+     *         ascending sofifa_id.
+     */
+    std::vector<uint32_t> top(std::string prefix, size_t k) {
+        std::vector<uint32_t> id_vector;
+        size_t depth;
+        uint32_t node = locate(fold(prefix), depth);
+        if (node == NO_NODE) {
+            return id_vector;
+        }
+        std::vector<ScoredId> scored;
+        best_of(node, k, scored);
+        for (auto& player : scored) {
+            id_vector.push_back(player.id);
+        }
         return id_vector;
     }
 
     /**
-     * Populates the PlayerNameTrie by reading and parsing data from a CSV file.
+     * Searches for players whose names start with a prefix within a given edit
+     * (Levenshtein) distance of a text, comparing UTF-8 characters and folding ASCII
+     * letter case. The trie is walked with one row of the edit distance table per
+     * character, and a subtree is left as soon as no name in it can match, or match
+     * closer than a prefix already did; the best players of such a subtree are then
+     * read from the cached best players.
+     *
+     * @param text The (possibly misspelled) name or prefix.
+     * @param max_distance The maximum number of edits.
+     * @param limit The maximum number of matches to return.
+     * @return Up to limit matches, by ascending distance, then by descending score and
+     *         ascending sofifa_id.
+     */
+    std::vector<NameMatch> fuzzy_search(const std::string& text, uint32_t max_distance, size_t limit) const {
+        FuzzyQuery query;
+        query.max_distance = max_distance;
+        query.limit = limit;
+        uint32_t value;
+        int remaining = 0;
+        for (auto& c : text) {
+            if (decode(fold(c), value, remaining)) {
+                query.characters.push_back(value);
+            }
+        }
+
+        FuzzyState state;
+        for (uint32_t j = 0; j <= query.characters.size(); j++) {
+            state.row.push_back(j);
+        }
+        state.best = std::min<uint32_t>(max_distance + 1, state.row.back());
+        fuzzy_walk(0, state, query);
+
+        std::vector<FuzzyCandidate>& candidates = query.candidates;
+        size_t count = std::min(limit, candidates.size());
+        std::partial_sort(candidates.begin(), candidates.begin() + count, candidates.end(),
+            [](const FuzzyCandidate& a, const FuzzyCandidate& b) {
+                return a.distance < b.distance || (a.distance == b.distance && better(a.player, b.player));
+            });
+        std::vector<NameMatch> matches;
+        for (size_t i = 0; i < count; i++) {
+            matches.push_back({ candidates[i].player.id, candidates[i].distance });
+        }
+        return matches;
+    }
+
+    /**
+     * Returns the number of bytes used by the cached best players.
+     */
+    size_t top_cache_bytes() const {
+        return top_slot.capacity() * sizeof(uint32_t) + top_entries.capacity() * sizeof(ScoredId);
+    }
+
+    /**
+     * Returns the number of bytes used by the trie.
+     */
+    size_t bytes() const {
+        return nodes.capacity() * sizeof(Node) + ids.capacity() * sizeof(IdEntry) + labels.capacity();
+    }
+
+    /**
+     * Estimates the number of bytes a trie with one node per character (31 links and
+     * an ID vector each) would use for the same names, excluding allocator overhead.
+     */
+    size_t character_trie_bytes() const {
+        // Every character of the label pool belongs to exactly one node
+        return (labels.size() + 1) * sizeof(CharacterNode) + ids.size() * sizeof(uint32_t);
+    }
+
+    /**
+     * Returns the number of nodes of the trie.
+     */
+    size_t node_count() const {
+        return nodes.size();
+    }
+
+    /**
+     * Populates the PlayerNameTrie by reading and parsing data from a CSV file, then
+     * building the trie in bulk.
      *
      * @param csv_filename The path to the CSV file containing the FIFA players data.
+     * @param threads The number of threads used for building (0 uses the hardware concurrency).
      */
-    void from_csv(std::string csv_filename) {
+    void from_csv(std::string csv_filename, unsigned threads = 0) {
         io::CSVReader<2, io::trim_chars<' '>, io::double_quote_escape<',', '\"'> > in(csv_filename);
+        std::vector<std::pair<std::string, uint32_t>> names;
         std::string player_name;
         uint32_t player_id;
 
         in.read_header(io::ignore_extra_column, "sofifa_id", "name");
 
         while (in.read_row(player_id, player_name)) {
-            insert(player_name, player_id);
-        }
-    }
-
-    ~PlayerNameTrie() {
-        for (int i = 0; i < ALPHABET_SIZE; i++) {
-            if (links[i]) {
-                delete links[i];
-            }
+            names.push_back({ player_name, player_id });
         }
+        build(names, threads);
     }
 };
 
-#endif // TRIE_H
\ No newline at end of file
+#endif // TRIE_H